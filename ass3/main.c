@@ -1,19 +1,67 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h> 
+#include <fnmatch.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>  
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/types.h> 
 #include <sys/stat.h> 
+#include <sys/un.h>
 #include <time.h> 
 #include <unistd.h> 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
 
 #define FILENAMELIM 31
 
+//diskbench measures the get path as well
+#if defined(BENCH)
+#define PART3
+#endif
+
+//options only diskput itself takes, not the tools below that borrow its code
+#if defined(PART4)
+#define PUTOPTIONS
+#endif
+
+//diskbatch runs every operation against a single mapping of the image, and diskd serves them over a socket
+#if defined(PART5) || defined(PART9)
+#define PART1
+#define PART2
+#define PART3
+#define PART4
+#endif
+
+//diskmv and diskrm use the directory code of diskput
+#if defined(PART10) || defined(PART11)
+#define PART4
+#endif
+
+//diskpack and diskunpack share the pack format and pipeline
+#if defined(PART12) || defined(PART13)
+#define PACKING
+#endif
+
+//tools that change the image go through the journal
+#if defined(PART4) || defined(PART6) || defined(PART7)
+#define JOURNALED
+#endif
+
 struct superblock_t{
     uint16_t block_size;
     uint32_t block_count;
@@ -38,8 +86,37 @@ struct datetime_t{
     uint8_t sec;
 };
 
+//the open disk image
+struct image_t{
+    char *name;
+    int fd;
+    char *map;
+    long size;
+    int rescan;
+};
+
+//FAT counters saved next to the image so tools don't have to rescan the FAT at startup.
+//they are only trusted while the image still has the size and mtime recorded here
+#define SUMMARYMAGIC 0x4d555346
+#define SUMMARYVERSION 2
+struct summary_t{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t block_count;
+    uint32_t FATblocks;
+    uint32_t reserved;
+    uint32_t available;
+    uint32_t allocated;
+    uint32_t cursor;
+};
+
 struct superblock_t SB;
 struct FAT_t FB;
+struct image_t IM;
 
 //helper function to check the results of malloc
 void *try_malloc(unsigned long int size){
@@ -51,6 +128,124 @@ void *try_malloc(unsigned long int size){
     return p;
 }
 
+//reads until the buffer is full or the input ends. returns the number of bytes read or -1 on error
+long readFull(int fd, char *buf, long len){
+    long total = 0;
+    while(total < len){
+        ssize_t n = read(fd, buf+total, len-total);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0) return -1;
+        if(n == 0) break;
+        total += n;
+    }
+    return total;
+}
+
+//writes a whole buffer or exits
+void writeAll(int fd, char *buf, long len){
+    while(len > 0){
+        ssize_t n = write(fd, buf, len);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0){
+            perror("Error writing");
+            exit(1);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+//seconds on the monotonic clock
+double nowSeconds(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+//counters and phase times reported by --stats. nothing is counted unless it was asked for, and the
+//counters are bumped with relaxed atomics since the pool's workers share them
+#define STAT(counter, n) do{ if(ST.enabled) __atomic_fetch_add(&ST.counter, (n), __ATOMIC_RELAXED); }while(0)
+#define STATSTEXT 1
+#define STATSJSON 2
+enum{PHASEOTHER, PHASESUPER, PHASESUMMARY, PHASERESOLVE, PHASETRANSFER, PHASECOMMIT, NPHASES};
+char *PHASENAMES[NPHASES] = {"other", "superblock", "fat_summary", "path_resolution", "data_transfer", "metadata_commit"};
+struct stats_t{
+    int enabled;
+    char *tool;
+    uint64_t fatreads;//FAT entries read, by chain walks and FAT scans
+    uint64_t direntries;//directory entries scanned
+    uint64_t blocks;//data blocks copied in or out of the image
+    uint64_t bytes;//data bytes written to the image or to local files
+    uint64_t hops;//links followed along FAT chains
+    uint64_t phasens[NPHASES];
+    double start;
+    struct rusage usage;
+};
+
+struct stats_t ST;
+__thread int curphase = PHASEOTHER;
+__thread double phasestart = 0;
+
+//moves the calling thread into a phase and returns the phase it was in, to be restored after.
+//time is only charged to the innermost phase, so a commit made during a transfer isn't counted twice.
+//phase times of pool workers are added up, so they can exceed the wall time
+int statsPhase(int phase){
+    if(!ST.enabled) return PHASEOTHER;
+    double now = nowSeconds();
+    if(phasestart > 0) __atomic_fetch_add(&ST.phasens[curphase], (uint64_t)((now-phasestart)*1e9), __ATOMIC_RELAXED);
+    int prev = curphase;
+    curphase = phase;
+    phasestart = now;
+    return prev;
+}
+
+//prints the counters to stderr when the tool exits, as text or JSON
+void printStats(void){
+    struct rusage usage;
+    int i;
+    statsPhase(PHASEOTHER);
+    getrusage(RUSAGE_SELF, &usage);
+    double wall = nowSeconds()-ST.start;
+    long minflt = usage.ru_minflt-ST.usage.ru_minflt;
+    long majflt = usage.ru_majflt-ST.usage.ru_majflt;
+    double user = usage.ru_utime.tv_sec-ST.usage.ru_utime.tv_sec + (usage.ru_utime.tv_usec-ST.usage.ru_utime.tv_usec)/1e6;
+    double sys = usage.ru_stime.tv_sec-ST.usage.ru_stime.tv_sec + (usage.ru_stime.tv_usec-ST.usage.ru_stime.tv_usec)/1e6;
+    if(ST.enabled == STATSJSON){
+        fprintf(stderr, "{\"tool\":\"%s\",\"wall_s\":%.6f,", ST.tool, wall);
+        fprintf(stderr, "\"counters\":{\"fat_entries_read\":%llu,\"dir_entries_scanned\":%llu,\"blocks_copied\":%llu,\"bytes_written\":%llu,\"chain_hops\":%llu},",
+            (unsigned long long)ST.fatreads, (unsigned long long)ST.direntries, (unsigned long long)ST.blocks, (unsigned long long)ST.bytes, (unsigned long long)ST.hops);
+        fprintf(stderr, "\"phases_s\":{");
+        for(i=0; i<NPHASES; i++){
+            fprintf(stderr, "%s\"%s\":%.6f", i ? "," : "", PHASENAMES[i], ST.phasens[i]/1e9);
+        }
+        fprintf(stderr, "},\"rusage\":{\"minor_faults\":%ld,\"major_faults\":%ld,\"user_s\":%.6f,\"sys_s\":%.6f,\"max_rss_kb\":%ld}}\n",
+            minflt, majflt, user, sys, usage.ru_maxrss);
+        return;
+    }
+    fprintf(stderr, "%s stats:\n", ST.tool);
+    fprintf(stderr, "  FAT entries read     %llu\n", (unsigned long long)ST.fatreads);
+    fprintf(stderr, "  dir entries scanned  %llu\n", (unsigned long long)ST.direntries);
+    fprintf(stderr, "  blocks copied        %llu\n", (unsigned long long)ST.blocks);
+    fprintf(stderr, "  bytes written        %llu\n", (unsigned long long)ST.bytes);
+    fprintf(stderr, "  chain hops           %llu\n", (unsigned long long)ST.hops);
+    for(i=0; i<NPHASES; i++){
+        fprintf(stderr, "  %-20s %.6f s\n", PHASENAMES[i], ST.phasens[i]/1e9);
+    }
+    fprintf(stderr, "  wall time            %.6f s (user %.6f s, sys %.6f s)\n", wall, user, sys);
+    fprintf(stderr, "  page faults          %ld minor, %ld major\n", minflt, majflt);
+    fprintf(stderr, "  max rss              %ld KB\n", usage.ru_maxrss);
+}
+
+//starts counting for --stats and reports at exit
+void statsStart(char *argv0){
+    char *slash = strrchr(argv0, '/');
+    ST.tool = slash ? slash+1 : argv0;
+    getrusage(RUSAGE_SELF, &ST.usage);
+    ST.start = nowSeconds();
+    phasestart = ST.start;
+    atexit(printStats);
+}
+
 //helper function to check if directory name matches while scanning through dirblocks
 int dirNameMatch(char *fp, char *subdirname, int ndx){
     if((fp[ndx] & 7) != 5) return 0;
@@ -64,542 +259,5287 @@ int fileNameMatch(char *fp, char *subdirname, int ndx){
 }
 
 //helper function to convert four bytes from disk into a number
-uint32_t fourbfield(char *fp, int ndx){
+uint32_t fourbfield(char *fp, int64_t ndx){
     return ((fp[ndx]&0xFF)<<24) + ((fp[ndx+1]&0xFF)<<16) + ((fp[ndx+2]&0xFF)<<8) + (fp[ndx+3]&0xFF);
 }
 
 //helper function to convert two bytes from disk into a number
-uint16_t twobfield(char *fp, int ndx){
+uint16_t twobfield(char *fp, int64_t ndx){
     return ((fp[ndx]&0xFF)<<8) + (fp[ndx+1]&0xFF);
 }
 
-uint8_t onebfield(char *fp, int ndx){
+uint8_t onebfield(char *fp, int64_t ndx){
     return fp[ndx]&0xFF;
 }
 
-#if defined(PART4)
-//helper function to set a struct to the current time
-void getCurrentTime(struct datetime_t *timeb){
-    struct tm *UTCtime;
-    time_t now = time(0);
-    UTCtime = gmtime(&now);
-    timeb->sec = (UTCtime->tm_sec);
-    timeb->min = (UTCtime->tm_min);
-    timeb->hour = (UTCtime->tm_hour);
-    timeb->day = (UTCtime->tm_mday);
-    timeb->month = (UTCtime->tm_mon+1);
-    timeb->year = ((UTCtime->tm_year+1900));
+//windowed mapping for images bigger than the memory budget. the whole image is still one reserved range
+//of address space, so pointers into it stay valid, but at most WM.max windows of WINDOWSIZE bytes are
+//mapped at a time. touching an unmapped window faults into windowFault, which maps it. when the cap is
+//reached a clock hand sweeps the mapped windows: one touched since the hand last passed has its access
+//revoked with mprotect and is spared, so the next touch faults it back in cheaply and marks it again,
+//and the first one left untouched is unmapped. windows holding the superblock and FAT are pinned for
+//good, and windows holding pages of the open journal transaction until it commits.
+//--mapcap=MB turns it on, and an image too big to map in one piece uses it with DEFAULTMAPCAP
+#define WINDOWSIZE (16L*1024*1024)
+#define DEFAULTMAPCAP 1024
+#define MINWINDOWS 8
+#define UNPINNED 0
+#define PINNEDTXN 1
+#define PINNEDFAT 2
+struct window_t{
+    int mapped;
+    int pinned;
+    int referenced;//touched since the clock hand last passed
+    int revoked;//mapped but PROT_NONE, so the next touch is seen
+};
+
+struct windows_t{
+    int enabled;
+    long cap;//MB of windows
+    uint32_t n;
+    uint32_t max;
+    uint32_t nmapped;
+    uint32_t hand;
+    struct window_t *w;
+    char lock;
+};
+
+struct windows_t WM;
+
+void windowLock(void){
+    while(__atomic_test_and_set(&WM.lock, __ATOMIC_ACQUIRE)) sched_yield();
+}
+
+void windowUnlock(void){
+    __atomic_clear(&WM.lock, __ATOMIC_RELEASE);
+}
+
+//length of window i, the last one may be short
+long windowLength(uint32_t i){
+    return IM.size-i*WINDOWSIZE < WINDOWSIZE ? IM.size-i*WINDOWSIZE : WINDOWSIZE;
+}
+
+//moves the clock hand until it finds an unpinned window that wasn't touched since the hand last passed,
+//revoking access to the touched ones on the way. returns WM.n if every mapped window is pinned
+uint32_t windowVictim(void){
+    uint32_t step;
+    for(step=0; step<2*WM.n; step++){//two turns clear every mark
+        uint32_t j = WM.hand;
+        WM.hand = (WM.hand+1)%WM.n;
+        if(!WM.w[j].mapped || WM.w[j].pinned != UNPINNED) continue;
+        if(!WM.w[j].referenced) return j;
+        WM.w[j].referenced = 0;
+        if(!WM.w[j].revoked && mprotect(IM.map+j*WINDOWSIZE, windowLength(j), PROT_NONE) == 0) WM.w[j].revoked = 1;
+    }
+    return WM.n;
+}
+
+//maps window i, or gives back access to it if the clock revoked it, and marks it touched. unmaps the
+//window the clock picks first if the cap is reached. the lock must be held. returns 0 if it can't be mapped
+int windowMap(uint32_t i){
+    if(WM.w[i].mapped){
+        if(WM.w[i].revoked && mprotect(IM.map+i*WINDOWSIZE, windowLength(i), PROT_READ | PROT_WRITE) < 0) return 0;
+        WM.w[i].revoked = 0;
+        WM.w[i].referenced = 1;
+        return 1;
+    }
+    if(WM.nmapped >= WM.max){
+        uint32_t victim = windowVictim();
+        if(victim < WM.n){//its dirty pages stay in the page cache
+            mmap(IM.map+victim*WINDOWSIZE, windowLength(victim), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+            WM.w[victim].mapped = 0;
+            WM.w[victim].revoked = 0;
+            WM.nmapped--;
+        }
+    }
+    if(mmap(IM.map+i*WINDOWSIZE, windowLength(i), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, IM.fd, i*WINDOWSIZE) == MAP_FAILED) return 0;
+    WM.w[i].mapped = 1;
+    WM.w[i].referenced = 1;
+    WM.nmapped++;
+    return 1;
+}
+
+//SIGSEGV handler: maps the window holding the faulting address and retries the access. a fault
+//anywhere else, or one that can't be served, is left to crash as usual
+void windowFault(int sig, siginfo_t *si, void *ctx){
+    char *addr = si->si_addr;
+    int served = 0;
+    if(addr >= IM.map && addr < IM.map+IM.size){
+        windowLock();
+        served = windowMap((addr-IM.map)/WINDOWSIZE);
+        windowUnlock();
+    }
+    if(!served) signal(SIGSEGV, SIG_DFL);
 }
 
-//writes the file contents and tracks what should be changed in FAT after everything is successfully written
-uint32_t writeFileContents(char *disk, char *inputfile, uint32_t filesize, uint32_t *FATaddresses, uint32_t *FATvalues){
-    uint32_t numfullblocks = filesize/SB.block_size;
+//maps and pins every window holding len bytes at offset off
+void windowPin(int64_t off, int64_t len, int pin){
+    if(!WM.enabled || len <= 0) return;
     uint32_t i;
-    uint32_t writeblock;
-    uint32_t j = SB.FATstart*SB.block_size;
-    for(i=0;i<numfullblocks;i++){
-        while(fourbfield(disk, j) != 0){
-            j += 4;
-        }
-        writeblock = (j-SB.FATstart*SB.block_size)/4*SB.block_size;
-        FATaddresses[i] = j;
-        FATvalues[i] = htonl(writeblock/SB.block_size);
-        memcpy(disk+writeblock, inputfile+i*SB.block_size, SB.block_size);
-        j += 4;
-    }
-    writeblock = (j-SB.FATstart*SB.block_size)/4*SB.block_size;
-    memcpy(disk+writeblock, inputfile+numfullblocks*SB.block_size, filesize%SB.block_size);
-    if(filesize%SB.block_size != 0){
-        FATaddresses[i] = j;
-        FATvalues[i++] = htonl(writeblock/SB.block_size);
-        j += 4;
+    windowLock();
+    for(i=off/WINDOWSIZE; i<=(off+len-1)/WINDOWSIZE; i++){
+        if(!windowMap(i)){
+            perror("Error mapping image window");
+            exit(1);
+        }
+        if(WM.w[i].pinned < pin) WM.w[i].pinned = pin;
     }
-    int k;
-    for(k=0; k<i;k++){
-        FATvalues[k] = FATvalues[k+1];
+    windowUnlock();
+}
+
+//unpins the windows pinned by a transaction once it has committed
+void windowUnpinTxn(void){
+    if(!WM.enabled) return;
+    uint32_t i;
+    windowLock();
+    for(i=0; i<WM.n; i++){
+        if(WM.w[i].pinned == PINNEDTXN) WM.w[i].pinned = UNPINNED;
     }
-    FATvalues[i-1] = htonl(-1);
-    return j;
+    windowUnlock();
 }
 
-//updates directory entries for inserting a new file. creates subdirectories if they don't exist. Extends parent directories if they are full.
-void writeDirInfo(char *fp, char *dirname, uint32_t prevnumblocks, uint32_t start, uint32_t numblocks, uint32_t newstartblock, struct stat *filedata, uint32_t uncheckedFAT){
-    if(dirname[0] == '/'){//get current directory or filename
-        dirname++;
-        if(dirname[0] == '\0'){
-            fprintf(stderr, "Input format: /subdir/subdir/filename\n");
+//reserves address space for the whole image and starts serving its windows on demand
+char *windowReserve(long size){
+    struct sigaction sa;
+    char *p = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(p == MAP_FAILED) return p;
+    WM.enabled = 1;
+    if(WM.cap <= 0) WM.cap = DEFAULTMAPCAP;
+    WM.n = (size+WINDOWSIZE-1)/WINDOWSIZE;
+    WM.max = WM.cap*1024*1024/WINDOWSIZE;
+    if(WM.max < MINWINDOWS) WM.max = MINWINDOWS;
+    WM.w = try_malloc(WM.n*sizeof(struct window_t));
+    memset(WM.w, 0, WM.n*sizeof(struct window_t));
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = windowFault;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, NULL);
+    return p;
+}
+
+//metadata journal. while a transaction is open every page holding changed FAT entries, directory
+//entries or superblock fields is remapped private, so none of it reaches the image until the
+//transaction commits: file data is flushed first, then the pages are written to the journal sidecar
+//and synced, and only then copied into the image. blocks freed in a transaction aren't reused
+//before it commits, so committed metadata never points at overwritten data
+#define JOURNALMAGIC 0x4c4e4a46
+#define COMMITMAGIC 0x4d4d4f43
+struct journal_t{
+    int enabled;
+    int fd;
+    long pagesize;
+    uint8_t *private;//one flag per page of the image
+    long *pages;
+    uint32_t npages;
+    uint32_t cap;
+    uint32_t *freed;//start and count pairs released in the open transaction
+    uint32_t nfreed;
+    uint32_t freedcap;
+    uint64_t seq;
+};
+
+//a transaction in the journal is a header, npages offset and page pairs, and a commit record
+struct jheader_t{
+    uint32_t magic;
+    uint32_t npages;
+    uint64_t seq;
+    uint64_t pagesize;
+};
+
+struct jcommit_t{
+    uint32_t magic;
+    uint32_t checksum;
+    uint64_t seq;
+};
+
+struct journal_t JN;
+
+//makes the pages holding len bytes at addr in the image private to the open transaction. called before
+//every metadata write
+void journalTouch(char *addr, long len){
+    if(!JN.enabled || len <= 0) return;
+    long page = (addr-IM.map)/JN.pagesize;
+    long last = (addr-IM.map+len-1)/JN.pagesize;
+    for(; page<=last; page++){
+        if(JN.private[page]) continue;
+        windowPin(page*JN.pagesize, JN.pagesize, PINNEDTXN);//a private page must never be unmapped
+        if(mmap(IM.map+page*JN.pagesize, JN.pagesize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, IM.fd, page*JN.pagesize) == MAP_FAILED){
+            perror("Error remapping journal page");
             exit(1);
         }
-        int i = 0;
-        char tempbuf[FILENAMELIM];
-        while(dirname[0]  != '/' && dirname[0] != '\0'){
-            tempbuf[i++] = dirname[0];
-            dirname++;
+        if(JN.npages == JN.cap){
+            JN.cap = JN.cap ? JN.cap*2 : 64;
+            long *grown = try_malloc(JN.cap*sizeof(long));
+            if(JN.npages > 0) memcpy(grown, JN.pages, JN.npages*sizeof(long));
+            free(JN.pages);
+            JN.pages = grown;
         }
-        while(i<31){
-            tempbuf[i++] = '\0';
-        };
-        if(dirname[0] == '\0'){//file
-            uint32_t nextblock = start;
-            for(i=0; i<numblocks*SB.block_size; i+=64){//scan to check if the file exists
-                if(i%SB.block_size == 0 && i != 0){
-                    nextblock = fourbfield(fp, SB.FATstart*SB.block_size + 4*(nextblock));
-                    if(nextblock == 0xFFFFFFFF){
-                        fprintf(stderr, "Corrupt directory.\n");
-                        exit(1);
-                    }
-                }
-                if(fileNameMatch(fp, tempbuf, i%SB.block_size+nextblock*SB.block_size)){
-                    fprintf(stderr, "file already exists.");
-                    exit(1);
-                }
-            }
-            nextblock = start;
-            for(i=0; i<numblocks*SB.block_size; i+=64){//find an open directory entry slot
-                if(i%SB.block_size == 0 && i != 0){
-                    nextblock = fourbfield(fp, SB.FATstart*SB.block_size + 4*(nextblock));
-                    if(nextblock == 0xFFFFFFFF){
-                        fprintf(stderr, "Corrupt directory.\n");
-                        exit(1);
-                    }
-                }
-                if(fourbfield(fp, i%SB.block_size+nextblock*SB.block_size) == 0){
-                //create new directory entry
-                    uint8_t status = 3;
-                    uint32_t startingblock = htonl((newstartblock-SB.FATstart*SB.block_size)/4);
-                    uint32_t numberofblocks;
-                    if((int)filedata->st_size/SB.block_size == 0){
-                        numberofblocks = htonl((int)filedata->st_size/SB.block_size);
-                    }else{
-                        numberofblocks = htonl((int)filedata->st_size/SB.block_size + 1);
-                    }
-                    uint32_t filesize = htonl((int)filedata->st_size);
-                    struct datetime_t *timeb = try_malloc(sizeof(struct datetime_t));
-                    getCurrentTime(timeb);
-                    uint16_t year = htons(timeb->year);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size, &status, 1);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+1, &startingblock, 4);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+5, &numberofblocks, 4);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+9, &filesize, 4);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+13, &year, 2);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+15, &(timeb->month), 1);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+16, &(timeb->day), 1);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+17, &(timeb->hour), 1);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+18, &(timeb->min), 1);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+19, &(timeb->sec), 1);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+20, &year, 2);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+22, &(timeb->month), 1);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+23, &(timeb->day), 1);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+24, &(timeb->hour), 1);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+25, &(timeb->min), 1);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+26, &(timeb->sec), 1);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+27, &tempbuf, 31);
-                    return;
-                }
-            }
-            //extend full directory if all are occupied
-            while(fourbfield(fp, uncheckedFAT) != 0){
-                uncheckedFAT += 4;
-            }
-            uint32_t temp = 0xFFFFFFFF;
-            memcpy(fp+uncheckedFAT, &temp, 4);//new file ending
-            temp = htonl((uncheckedFAT-SB.FATstart*SB.block_size)/4);
-            memcpy(fp + (SB.FATstart*SB.block_size + nextblock*4), &temp, 4);//rewrite old file ending
-            temp = htonl(fourbfield(fp, prevnumblocks)+1);
-            memcpy(fp + prevnumblocks, &temp, 4);//extend blocksize
-            temp = htonl(fourbfield(fp, prevnumblocks+4)+SB.block_size);
-            memcpy(fp + prevnumblocks+4, &temp, 4);//extend filesize
-            uint8_t status = 3;
-            uint32_t startingblock = htonl((newstartblock-SB.FATstart*SB.block_size)/4);
-            uint32_t numberofblocks;
-            if((int)filedata->st_size%SB.block_size == 0){
-                numberofblocks = htonl((int)filedata->st_size/SB.block_size);
-            }else{
-                numberofblocks = htonl((int)filedata->st_size/SB.block_size + 1);
-            }
-            uint32_t filesize = htonl((int)filedata->st_size);
-            struct datetime_t *timeb = try_malloc(sizeof(struct datetime_t));
-            getCurrentTime(timeb);
-            uint16_t year = htons(timeb->year);
-            //create directory entry in newly created block (extended parent directory)
-            memset(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size, 0, SB.block_size);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size, &status, 1);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+1, &startingblock, 4);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+5, &numberofblocks, 4);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+9, &filesize, 4);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+13, &year, 2);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+15, &(timeb->month), 1);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+16, &(timeb->day), 1);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+17, &(timeb->hour), 1);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+18, &(timeb->min), 1);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+19, &(timeb->sec), 1);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+20, &year, 2);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+22, &(timeb->month), 1);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+23, &(timeb->day), 1);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+24, &(timeb->hour), 1);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+25, &(timeb->min), 1);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+26, &(timeb->sec), 1);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+27, &tempbuf, strlen(tempbuf)+1);
-            int ndx;
-            for(ndx=0; ndx<8; ndx++){
-                memset(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+58+ndx*64, 0xFF, 6);
-            }
-        }else{//directory
-            uint32_t nextblock = start;
-            for(i=0; i<numblocks*SB.block_size; i+=64){
-                if(i%SB.block_size == 0 && i != 0){
-                    nextblock = fourbfield(fp, SB.FATstart*SB.block_size + 4*(nextblock));
-                    if(nextblock == 0xFFFFFFFF){
-                        fprintf(stderr, "Corrupt directory.\n");
-                        exit(1);
-                    }
-                }
-                if(dirNameMatch(fp, tempbuf, i%SB.block_size+nextblock*SB.block_size)){//directory exists
-                    uint32_t startblk = fourbfield(fp, i%SB.block_size+nextblock*SB.block_size+1);
-                    uint32_t dirsizeloc = i%SB.block_size+nextblock*SB.block_size+5;
-                    uint32_t dirsizeblk = fourbfield(fp, dirsizeloc);
-                    writeDirInfo(fp, dirname, dirsizeloc, startblk, dirsizeblk, newstartblock, filedata, uncheckedFAT);
-                    return;
-                }
-            }
-            while(fourbfield(fp, uncheckedFAT) != 0){//find a place to put new directory
-                uncheckedFAT += 4;
-            }
+        JN.pages[JN.npages++] = page;
+        JN.private[page] = 1;
+    }
+}
 
-            uint32_t temp = 0xFFFFFFFF;
-            memcpy(fp+uncheckedFAT, &temp, 4);
-            uint8_t status = 5;
-            uint32_t startblk = (uncheckedFAT-SB.FATstart*SB.block_size)/4;
-            uint32_t startingblock = htonl((uncheckedFAT-SB.FATstart*SB.block_size)/4);
-            uint32_t numberofblocks = htonl(1);
-            uint32_t filesize = htonl(SB.block_size);
-            struct datetime_t *timeb = try_malloc(sizeof(struct datetime_t));
-            getCurrentTime(timeb);
-            uint16_t year = htons(timeb->year);
-            nextblock = start;
-            //find where to insert in parent directory
-            for(i=0; i<numblocks*SB.block_size; i+=64){
-                if(i%SB.block_size == 0 && i != 0){
-                    nextblock = fourbfield(fp, SB.FATstart*SB.block_size + 4*(nextblock));
-                    if(nextblock == 0xFFFFFFFF){
-                        fprintf(stderr, "Corrupt directory.\n");
-                        exit(1);
-                    }
-                }
-                if(fourbfield(fp, i%SB.block_size+nextblock*SB.block_size) == 0){//create directory entry
-                    memset(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size, 0, SB.block_size);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size, &status, 1);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+1, &startingblock, 4);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+5, &numberofblocks, 4);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+9, &filesize, 4);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+13, &year, 2);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+15, &(timeb->month), 1);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+16, &(timeb->day), 1);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+17, &(timeb->hour), 1);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+18, &(timeb->min), 1);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+19, &(timeb->sec), 1);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+20, &year, 2);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+22, &(timeb->month), 1);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+23, &(timeb->day), 1);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+24, &(timeb->hour), 1);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+25, &(timeb->min), 1);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+26, &(timeb->sec), 1);
-                    memcpy(fp+i%SB.block_size+nextblock*SB.block_size+27, &tempbuf, strlen(tempbuf)+1);
-                    int ndx;
-                    for(ndx=0; ndx<8; ndx++){
-                        memset(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+58+ndx*64, 0xFF, 6);
-                    }
-                    writeDirInfo(fp, dirname, i%SB.block_size+nextblock*SB.block_size+5, startblk, 1, newstartblock, filedata, uncheckedFAT+4);
-                    return;
-                }
-            }
-            //extend if parent directory is full
-            while(fourbfield(fp, uncheckedFAT) != 0){//find a place
-                uncheckedFAT += 4;
-            }
-            temp = 0xFFFFFFFF;
-            memcpy(fp+uncheckedFAT, &temp, 4);//set new endblock in FAT
-            temp = htonl((uncheckedFAT-SB.FATstart*SB.block_size)/4);
-            memcpy(fp + (SB.FATstart*SB.block_size + nextblock*4), &temp, 4);//rewrite old endblock in FAT
-            temp = htonl(fourbfield(fp, prevnumblocks)+1);
-            memcpy(fp + prevnumblocks, &temp, 4);//extend num blocks
-            temp = htonl(fourbfield(fp, prevnumblocks+4)+SB.block_size);
-            memcpy(fp + prevnumblocks+4, &temp, 4);//extend filesize
-            memset(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size, 0, SB.block_size);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size, &status, 1);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+1, &startingblock, 4);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+5, &numberofblocks, 4);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+9, &filesize, 4);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+13, &year, 2);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+15, &(timeb->month), 1);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+16, &(timeb->day), 1);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+17, &(timeb->hour), 1);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+18, &(timeb->min), 1);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+19, &(timeb->sec), 1);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+20, &year, 2);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+22, &(timeb->month), 1);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+23, &(timeb->day), 1);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+24, &(timeb->hour), 1);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+25, &(timeb->min), 1);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+26, &(timeb->sec), 1);
-            memcpy(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+27, &tempbuf, strlen(tempbuf)+1);
-            int ndx;
-            for(ndx=0; ndx<8; ndx++){
-                memset(fp+(uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+58+ndx*64, 0xFF, 6);
-            }
-            writeDirInfo(fp, dirname, (uncheckedFAT-SB.FATstart*SB.block_size)/4*SB.block_size+5, startblk, 1, newstartblock, filedata, uncheckedFAT+4);
-        }
-    }else{
-        fprintf(stderr, "Input format: /subdir/subdir/filename\n");
-        exit(1);
+//file data is moved in and out of the image through one of these backends, chosen with --io=.
+//the FAT and directories are always read through the mapping. a request that touches a page made
+//private by the journal goes through the mapping too, since the file doesn't hold its contents yet
+struct ioreq_t{
+    char *buf;
+    int64_t off;
+    int64_t len;
+};
+
+struct backend_t{
+    char *name;
+    void (*init)(void);
+    int (*read)(struct ioreq_t *reqs, int n);
+    int (*write)(struct ioreq_t *reqs, int n);
+};
+
+//whether a byte range of the image has to be accessed through the mapping
+int ioMapped(struct ioreq_t *r){
+    if(!JN.enabled || JN.npages == 0) return 0;
+    long page = r->off/JN.pagesize;
+    long last = (r->off+r->len-1)/JN.pagesize;
+    for(; page<=last; page++){
+        if(JN.private[page]) return 1;
     }
+    return 0;
 }
 
-//writes the file contents and tracks which parts of fat should be updated. Creates directory entries. Updates FAT
-void putFile(char *ifile, char *olocation, char *fp){
-    int ifp;
-    struct stat sf;
-    char *p;
-    if((ifp = open(ifile, O_RDONLY)) >= 0){
-        fstat(ifp, &sf);
-        p = mmap(NULL, sf.st_size, PROT_READ, MAP_SHARED, ifp, 0);
-    }else{
-        fprintf(stderr, "Can't open file.\n");
-        close(ifp);
-        exit(1);
+int mmapRead(struct ioreq_t *reqs, int n){
+    int i;
+    for(i=0; i<n; i++){
+        memcpy(reqs[i].buf, IM.map+reqs[i].off, reqs[i].len);
     }
-    uint32_t filesize = (uint32_t)sf.st_size;
-    uint32_t fileblocks = filesize/SB.block_size + (filesize%SB.block_size == 0 ? 0 : 1); 
-    uint32_t FATaddresses[fileblocks];
-    uint32_t FATvalues[fileblocks];
-    uint32_t uncheckedFAT = writeFileContents(fp, p, filesize, FATaddresses, FATvalues);
-    writeDirInfo(fp, olocation, 26, SB.rootstart, SB.root_block_count, FATaddresses[0], &sf, uncheckedFAT);
+    return 0;
+}
+
+int mmapWrite(struct ioreq_t *reqs, int n){
     int i;
-    for(i=0; i<fileblocks;i++){
-        memcpy(fp+FATaddresses[i], FATvalues+i, 4);
+    for(i=0; i<n; i++){
+        memcpy(IM.map+reqs[i].off, reqs[i].buf, reqs[i].len);
     }
+    return 0;
 }
-#endif
 
-#if defined(PART3)
-//transfers file from disk to specified file/location on current linux machine
-void transferFile(char *fp, char *filename, uint32_t filesizeblk, uint32_t filesize, uint32_t startblk){
-    FILE *new;
-    if((new = fopen(filename, "wb")) < 0){
-        fprintf(stderr, "Can't open disk file.\n");
-        fclose(new);
-        exit(1);
+//finishes one request with pread or pwrite, retrying short transfers
+int preadOne(struct ioreq_t *r, int64_t done, int write){
+    if(ioMapped(r)) return write ? mmapWrite(r, 1) : mmapRead(r, 1);
+    while(done < r->len){
+        ssize_t n = write ? pwrite(IM.fd, r->buf+done, r->len-done, r->off+done) : pread(IM.fd, r->buf+done, r->len-done, r->off+done);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return -1;
+        done += n;
     }
+    return 0;
+}
+
+int preadRead(struct ioreq_t *reqs, int n){
     int i;
-    uint32_t nextblock = startblk;
-    for(i=0; i<filesizeblk-1; i++){
-        fwrite(fp+nextblock*SB.block_size, SB.block_size, 1, new);
-        nextblock = fourbfield(fp, SB.FATstart*SB.block_size + 4*(nextblock));
+    for(i=0; i<n; i++){
+        if(preadOne(&reqs[i], 0, 0) < 0) return -1;
     }
-    uint32_t remainingbytes = filesize%SB.block_size==0 ? SB.block_size : filesize%SB.block_size;
-    fwrite(fp+nextblock*SB.block_size, remainingbytes, 1, new);
+    return 0;
 }
 
-//locates where the file to retrieve is in disk
-void getFile(char* dirname, char* fp, int start, int numblocks, char *filename){
-    if(dirname[0] == '/'){
-        dirname++;
-        if(dirname[0] == '\0'){
-            fprintf(stderr, "Input format: /subdir/subdir/filename\n");
-            exit(1);
-        }
-        int i = 0;
-        char tempbuf[FILENAMELIM];
-        while(dirname[0]  != '/' && dirname[0] != '\0'){
-            tempbuf[i++] = dirname[0];
-            dirname++;
-        }
-        tempbuf[i] = '\0';
-        uint32_t nextblock = start;
-        for(i=0; i<numblocks*SB.block_size; i+=64){
-            if(i%SB.block_size == 0 && i != 0){
-                nextblock = fourbfield(fp, SB.FATstart*SB.block_size + 4*(nextblock));
-                if(nextblock == 0xFFFFFFFF){
-                    fprintf(stderr, "File not found.\n");
-                    exit(1);
-                }
-            }
-            if(dirNameMatch(fp, tempbuf, i%SB.block_size+nextblock*SB.block_size) || fileNameMatch(fp, tempbuf, i%SB.block_size+nextblock*SB.block_size)){
-                uint32_t startb = fourbfield(fp, i%SB.block_size+nextblock*SB.block_size+1);
-                uint32_t dirsizeb = fourbfield(fp, i%SB.block_size+nextblock*SB.block_size+5);
-                uint32_t filesize = fourbfield(fp, i%SB.block_size+nextblock*SB.block_size+9);
-                if(dirname[0] == '\0'){//is a file
-                    transferFile(fp, filename, dirsizeb, filesize, startb);
-                    return;
-                }else{//is a directory
-                    getFile(dirname, fp, startb, dirsizeb, filename);
-                    return;
-                }
-            }
-        }
-    }else{
-        fprintf(stderr, "Input format: /subdir/subdir/filename\n");
-        exit(1);
+int preadWrite(struct ioreq_t *reqs, int n){
+    int i;
+    for(i=0; i<n; i++){
+        if(preadOne(&reqs[i], 0, 1) < 0) return -1;
     }
+    return 0;
 }
-#endif
 
-#if defined(PART2)
-//prints information to screen about every file in a directory
-void printFileInfo(char* fp, uint32_t start, uint32_t numblocks){
-    int i;
-    uint32_t nextblock = start;
-    for(i=0;i<numblocks*SB.block_size;i+=64){
-        if(i%SB.block_size == 0 && i != 0){
-            nextblock = fourbfield(fp, SB.FATstart*SB.block_size + 4*(nextblock));
-            if(nextblock == 0xFFFFFFFF)return;
-        }
-        if((fp[i%SB.block_size+nextblock*SB.block_size] & 3) == 3){
-            printf("F ");
-        }else if((fp[i%SB.block_size+nextblock*SB.block_size] & 7) == 5){
-            printf("D ");
-        }else{
-            continue;
-        }
-        uint32_t filesize = fourbfield(fp, i%SB.block_size+nextblock*SB.block_size+9);
-        char filename[FILENAMELIM];
-        int x = 0;
-        for(x=0; x<FILENAMELIM; x++){
-            filename[x] = fp[i%SB.block_size+27+nextblock*SB.block_size+x];
-        }
-        uint16_t year = twobfield(fp, i%SB.block_size+nextblock*SB.block_size+20);
-        uint8_t month = onebfield(fp, i%SB.block_size+nextblock*SB.block_size+22);
-        uint8_t day = onebfield(fp, i%SB.block_size+nextblock*SB.block_size+23);
-        uint8_t hour = onebfield(fp, i%SB.block_size+nextblock*SB.block_size+24);
-        uint8_t minute = onebfield(fp, i%SB.block_size+nextblock*SB.block_size+25);
-        uint8_t second = onebfield(fp, i%SB.block_size+nextblock*SB.block_size+26);
-        printf("%10d %30s ", filesize, filename);
-        printf("%4d/%02d/%02d %2d:%02d:%02d\n", year, month, day, (hour+17)%24, minute, second);
+//io_uring set up with the raw system calls. up to URINGDEPTH requests are in flight at once and
+//the ring is shared by all threads under a lock
+#define URINGDEPTH 32
+#define URINGMAXLEN (1<<30)
+struct uring_t{
+    int fd;
+    unsigned *sqhead;
+    unsigned *sqtail;
+    unsigned *sqmask;
+    unsigned *sqarray;
+    unsigned *cqhead;
+    unsigned *cqtail;
+    unsigned *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned entries;
+    pthread_mutex_t lock;
+};
+
+struct uring_t UR;
+
+struct backend_t BACKENDS[];
+struct backend_t *IO;
+
+//creates the ring and maps its queues. falls back to pread when the kernel doesn't allow io_uring
+void uringInit(void){
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    UR.fd = syscall(__NR_io_uring_setup, URINGDEPTH, &params);
+    if(UR.fd < 0){
+        fprintf(stderr, "io_uring not available, using pread.\n");
+        IO = &BACKENDS[1];
+        return;
+    }
+    long sqsize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    long cqsize = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP && cqsize > sqsize) sqsize = cqsize;
+    char *sq = mmap(NULL, sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, UR.fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP)){
+        cq = mmap(NULL, cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, UR.fd, IORING_OFF_CQ_RING);
     }
+    UR.sqes = mmap(NULL, params.sq_entries*sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, UR.fd, IORING_OFF_SQES);
+    if(sq == MAP_FAILED || cq == MAP_FAILED || UR.sqes == MAP_FAILED){
+        fprintf(stderr, "io_uring not available, using pread.\n");
+        close(UR.fd);
+        IO = &BACKENDS[1];
+        return;
+    }
+    UR.sqhead = (unsigned *)(sq+params.sq_off.head);
+    UR.sqtail = (unsigned *)(sq+params.sq_off.tail);
+    UR.sqmask = (unsigned *)(sq+params.sq_off.ring_mask);
+    UR.sqarray = (unsigned *)(sq+params.sq_off.array);
+    UR.cqhead = (unsigned *)(cq+params.cq_off.head);
+    UR.cqtail = (unsigned *)(cq+params.cq_off.tail);
+    UR.cqmask = (unsigned *)(cq+params.cq_off.ring_mask);
+    UR.cqes = (struct io_uring_cqe *)(cq+params.cq_off.cqes);
+    UR.entries = params.sq_entries;
+    pthread_mutex_init(&UR.lock, NULL);
 }
 
-//finds the directory to print information about.
-void printDirInfo(char* dirname, char* fp, int start, int numblocks){
-    if(dirname[0] == '/'){
-        dirname++;
-        if(dirname[0] == '\0'){
-            printFileInfo(fp, start, numblocks);
-            return;
+//submits all the requests, keeping the ring full, and waits for them. short transfers are
+//finished with pread or pwrite
+int uringRun(struct ioreq_t *reqs, int n, int write){
+    int submitted = 0, completed = 0, inflight = 0, failed = 0;
+    int64_t *lens = try_malloc((n+1)*sizeof(int64_t));
+    pthread_mutex_lock(&UR.lock);
+    while(completed < n){
+        unsigned tail = *UR.sqtail;
+        int queued = 0;
+        while(submitted < n && inflight < (int)UR.entries){
+            struct ioreq_t *r = &reqs[submitted];
+            if(ioMapped(r)){//handled through the mapping, nothing to submit
+                if(write) mmapWrite(r, 1);
+                else mmapRead(r, 1);
+                lens[submitted++] = r->len;
+                completed++;
+                continue;
+            }
+            unsigned ndx = tail & *UR.sqmask;
+            struct io_uring_sqe *sqe = &UR.sqes[ndx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = IM.fd;
+            sqe->addr = (unsigned long)r->buf;
+            sqe->len = r->len > URINGMAXLEN ? URINGMAXLEN : r->len;
+            sqe->off = r->off;
+            sqe->user_data = submitted;
+            UR.sqarray[ndx] = ndx;
+            tail++;
+            submitted++;
+            inflight++;
+            queued++;
         }
-        int i = 0;
-        char tempbuf[FILENAMELIM];
-        while(dirname[0]  != '/' && dirname[0] != '\0'){
-            tempbuf[i++] = dirname[0];
-            dirname++;
+        if(queued == 0 && inflight == 0) continue;
+        __atomic_store_n(UR.sqtail, tail, __ATOMIC_RELEASE);
+        if(syscall(__NR_io_uring_enter, UR.fd, queued, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR){
+            failed = 1;
+            break;
         }
-        tempbuf[i] = '\0';
-        uint32_t nextblock = start;
-        for(i=0; i<numblocks*SB.block_size; i+=64){
-            if(i%SB.block_size == 0 && i != 0){
-                nextblock = fourbfield(fp, SB.FATstart*SB.block_size + 4*(nextblock));
-                if(nextblock == 0xFFFFFFFF){
-                    fprintf(stderr, "Directory corrupt.\n");
-                    exit(1);
-                }
-            }
-            if(dirNameMatch(fp, tempbuf, i%SB.block_size+nextblock*SB.block_size)){
-                uint32_t startb = fourbfield(fp, i%SB.block_size+nextblock*SB.block_size+1);
-                uint32_t dirsizeb = fourbfield(fp, i%SB.block_size+nextblock*SB.block_size+5);
-                if(dirname[0] == '\0'){
-                    printFileInfo(fp, startb, dirsizeb);
-                    return;
-                }else{
-                    printDirInfo(dirname, fp, startb, dirsizeb);
-                    return;
-                }
-            }
+        unsigned head = *UR.cqhead;
+        unsigned ctail = __atomic_load_n(UR.cqtail, __ATOMIC_ACQUIRE);
+        for(; head != ctail; head++){
+            struct io_uring_cqe *cqe = &UR.cqes[head & *UR.cqmask];
+            if(cqe->res < 0) failed = 1;
+            else lens[cqe->user_data] = cqe->res;
+            inflight--;
+            completed++;
         }
-        fprintf(stderr, "Directory not found.\n");
-    }else{
-        fprintf(stderr, "Input format: /subdir/subdir/subdir\n");
-        exit(1);
+        __atomic_store_n(UR.cqhead, head, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&UR.lock);
+    int i;
+    for(i=0; i<n && !failed; i++){
+        if(lens[i] < reqs[i].len && preadOne(&reqs[i], lens[i], write) < 0) failed = 1;
     }
+    free(lens);
+    return failed ? -1 : 0;
 }
-#endif
 
-#if defined(PART1)
-//prints information from the super block and FAT
-void printDiskInfo(void){
-    printf("Super block information:\n");
-    printf("Block size: %d\n", SB.block_size);
-    printf("Block count: %d\n", SB.block_count);
-    printf("FAT starts: %d\n", SB.FATstart);
-    printf("FAT blocks: %d\n", SB.FATblocks);
-    printf("Root directory start: %d\n", SB.rootstart);
-    printf("Root directory blocks: %d\n\n", SB.root_block_count);
-    printf("FAT information:\n");
-    printf("Free Blocks: %d\n", FB.available);
-    printf("Reserved Blocks: %d\n", FB.reserved);
-    printf("Allocated Blocks: %d\n", FB.allocated);
-}
-#endif
-
-//iterates through the FAT to count the allocated/reserved/free blocks
-void readFATinfo(char* fp){
-    FB.reserved = 0;
-    FB.available = 0;
-    long FS = SB.block_size*SB.FATstart;
-    int i;
-    uint32_t temp;
-    for(i=0; i<SB.FATblocks*SB.block_size; i+=4){
-        temp = fourbfield(fp, FS+i);
-        if(temp == 0){
-            FB.available++;
-        }else if(temp == 1){
-            FB.reserved++;
+int uringRead(struct ioreq_t *reqs, int n){
+    return uringRun(reqs, n, 0);
+}
+
+int uringWrite(struct ioreq_t *reqs, int n){
+    return uringRun(reqs, n, 1);
+}
+
+//reads are split into requests of this size so several of them can be in flight
+#define IOCHUNK (128<<10)
+#define IOBUFSIZE (8*IOCHUNK)
+
+#define MMAPIO 0
+struct backend_t BACKENDS[] = {
+    {"mmap", NULL, mmapRead, mmapWrite},
+    {"pread", NULL, preadRead, preadWrite},
+    {"uring", uringInit, uringRead, uringWrite},
+};
+#define NBACKENDS (sizeof(BACKENDS)/sizeof(BACKENDS[0]))
+
+struct backend_t *IO = &BACKENDS[MMAPIO];
+
+//selects the backend named by --io=
+void pickBackend(char *name){
+    unsigned i;
+    for(i=0; i<NBACKENDS; i++){
+        if(!strcmp(BACKENDS[i].name, name)){
+            IO = &BACKENDS[i];
+            return;
         }
     }
-    FB.allocated = SB.block_count - FB.reserved - FB.available;
+    fprintf(stderr, "Unknown I/O backend %s (mmap, pread or uring).\n", name);
+    exit(1);
 }
 
-//reads the superblock to get information about the filesystem
-void readSuperBlock(char *fp){    
-    SB.block_size = twobfield(fp, 8);
-    SB.block_count = fourbfield(fp, 10);
-    SB.FATstart = fourbfield(fp, 14);
-    SB.FATblocks = fourbfield(fp, 18);
-    SB.rootstart = fourbfield(fp, 22);
-    SB.root_block_count = fourbfield(fp, 26);
-    readFATinfo(fp);
+//helper function to read the FAT entry of a block
+uint32_t fatGet(char *fp, uint32_t block){
+    STAT(fatreads, 1);
+    STAT(hops, 1);
+    return fourbfield(fp, (int64_t)SB.FATstart*SB.block_size + 4*(int64_t)block);
 }
 
-int main(int argc, char* argv[]){
-    char* disk_name;
-    int fp;
+//bumped on every FAT write so cached chain indexes know when they may be stale
+uint64_t FATgen = 0;
+
+//helper function to write the FAT entry of a block
+void fatSet(char *fp, uint32_t block, uint32_t value){
+    uint32_t temp = htonl(value);
+    FATgen++;
+    journalTouch(fp + SB.FATstart*SB.block_size + 4*(long)block, 4);
+    memcpy(fp + SB.FATstart*SB.block_size + 4*(long)block, &temp, 4);
+}
+
+//number of blocks in the chain of a directory entry. for files it follows from the
+//file size since older versions of diskput recorded 0 blocks for small files
+uint32_t entryBlocks(char *entry){
+    if((entry[0] & 7) == 5) return fourbfield(entry, 5);
+    uint32_t size = fourbfield(entry, 9);
+    return size/SB.block_size + (size%SB.block_size == 0 ? 0 : 1);
+}
+
+//walks the 64-byte entries of a directory's block chain
+struct diriter_t{
+    uint32_t block;
+    uint32_t left;
+    uint32_t ndx;
+};
+
+//a run of contiguous blocks in a file's chain
+struct extent_t{
+    uint32_t start;
+    uint32_t count;
+};
+
+//starts iterating a directory of numblocks blocks beginning at start
+void dirIterInit(struct diriter_t *it, uint32_t start, uint32_t numblocks){
+    it->block = start;
+    it->left = numblocks;
+    it->ndx = 0;
+}
+
+//returns the next entry of the directory, or NULL at the end of its chain
+char *dirIterNext(char *fp, struct diriter_t *it){
+    if(it->left == 0) return NULL;
+    if(it->ndx == SB.block_size){
+        if(--it->left == 0) return NULL;
+        STAT(fatreads, 1);
+        STAT(hops, 1);
+        it->block = fourbfield(fp, (int64_t)SB.FATstart*SB.block_size + 4*(int64_t)it->block);
+        if(it->block == 0xFFFFFFFF || it->block >= SB.block_count) return NULL;
+        it->ndx = 0;
+    }
+    char *entry = fp + (long)it->block*SB.block_size + it->ndx;
+    STAT(direntries, 1);
+    it->ndx += 64;
+    return entry;
+}
+
+//in-memory hash index of a directory's names, keyed by the directory's start block. it is built by one
+//walk of the directory the first time the directory is looked up, and after that lookups, duplicate
+//checks and finding free slots don't walk the directory again. inserts update it; anything that moves
+//or rewrites entries behind its back bumps DIRgen, which makes every index rebuild on next use
+#define DIRINDEXBUCKETS 1024
+#define DIRINDEXEMPTY 0
+#define DIRINDEXREMOVED 1
+struct dirindex_t{
+    uint32_t start;
+    uint64_t gen;
+    uint32_t mask;
+    uint32_t used;
+    uint64_t *slots;//image offsets of the entries, or DIRINDEXEMPTY/DIRINDEXREMOVED
+    uint64_t *free;//image offsets of unused entries, in directory order from freehead
+    uint32_t nfree;
+    uint32_t freehead;
+    uint32_t freecap;
+    uint32_t last;//last block of the directory's chain
+    struct dirindex_t *next;
+};
+
+struct dirindex_t *DI[DIRINDEXBUCKETS];
+uint64_t DIRgen = 0;
+pthread_mutex_t DIlock = PTHREAD_MUTEX_INITIALIZER;
+
+//FNV-1a of an entry name
+uint32_t nameHash(char *name){
+    uint32_t hash = 2166136261u;
+    int i;
+    for(i=0; i<FILENAMELIM && name[i] != '\0'; i++){
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+//adds an entry to the hash table, doubling it when it gets half full
+void dirIndexPut(struct dirindex_t *d, uint64_t off){
+    if((d->used+1)*2 > d->mask+1){
+        uint64_t *old = d->slots;
+        uint32_t oldsize = d->mask+1;
+        uint32_t i;
+        d->mask = oldsize*2-1;
+        d->slots = try_malloc((d->mask+1)*sizeof(uint64_t));
+        memset(d->slots, 0, (d->mask+1)*sizeof(uint64_t));
+        d->used = 0;
+        for(i=0; i<oldsize; i++){
+            if(old[i] > DIRINDEXREMOVED) dirIndexPut(d, old[i]);
+        }
+        free(old);
+    }
+    uint32_t h = nameHash(IM.map+off+27) & d->mask;
+    while(d->slots[h] > DIRINDEXREMOVED) h = (h+1) & d->mask;
+    if(d->slots[h] == DIRINDEXEMPTY) d->used++;
+    d->slots[h] = off;
+}
+
+//remembers an unused entry of the directory
+void dirIndexFree(struct dirindex_t *d, uint64_t off){
+    if(d->nfree == d->freecap){
+        d->freecap = d->freecap ? d->freecap*2 : 16;
+        uint64_t *grown = try_malloc(d->freecap*sizeof(uint64_t));
+        if(d->nfree > 0) memcpy(grown, d->free, d->nfree*sizeof(uint64_t));
+        free(d->free);
+        d->free = grown;
+    }
+    d->free[d->nfree++] = off;
+}
+
+//returns the index of a directory, building it if it doesn't exist or is out of date. DIlock must be held
+struct dirindex_t *dirIndexGet(char *fp, uint32_t start, uint32_t numblocks){
+    struct dirindex_t **bucket = &DI[start%DIRINDEXBUCKETS];
+    struct dirindex_t *d;
+    for(d=*bucket; d!=NULL; d=d->next){
+        if(d->start == start) break;
+    }
+    if(d != NULL && d->gen == DIRgen) return d;
+    if(d == NULL){
+        d = try_malloc(sizeof(struct dirindex_t));
+        d->start = start;
+        d->next = *bucket;
+        *bucket = d;
+    }else{
+        free(d->slots);
+        free(d->free);
+    }
+    d->gen = DIRgen;
+    d->mask = 15;
+    d->used = 0;
+    d->slots = try_malloc((d->mask+1)*sizeof(uint64_t));
+    memset(d->slots, 0, (d->mask+1)*sizeof(uint64_t));
+    d->free = NULL;
+    d->nfree = 0;
+    d->freehead = 0;
+    d->freecap = 0;
+    struct diriter_t it;
+    char *entry;
+    dirIterInit(&it, start, numblocks);
+    while((entry = dirIterNext(fp, &it)) != NULL){
+        if((entry[0] & 3) == 3 || (entry[0] & 7) == 5){
+            dirIndexPut(d, entry-fp);
+        }else if((entry[0] & 1) == 0){
+            dirIndexFree(d, entry-fp);
+        }
+    }
+    d->last = it.block;
+    return d;
+}
+
+//finds a file or directory by name in a directory through its index. returns NULL if it isn't there
+char *dirIndexFind(char *fp, uint32_t start, uint32_t numblocks, char *name){
+    int phase = statsPhase(PHASERESOLVE);
+    pthread_mutex_lock(&DIlock);
+    struct dirindex_t *d = dirIndexGet(fp, start, numblocks);
+    uint32_t h = nameHash(name) & d->mask;
+    char *entry = NULL;
+    for(; d->slots[h] != DIRINDEXEMPTY; h=(h+1) & d->mask){
+        if(d->slots[h] == DIRINDEXREMOVED) continue;
+        char *e = fp+d->slots[h];
+        if(dirNameMatch(e, name, 0) || fileNameMatch(e, name, 0)){
+            entry = e;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&DIlock);
+    statsPhase(phase);
+    return entry;
+}
+
+//records a new entry written into a directory. a directory without an index is left to be indexed when it's next used
+void dirIndexAdd(uint32_t start, char *entry){
+    pthread_mutex_lock(&DIlock);
+    struct dirindex_t *d;
+    for(d=DI[start%DIRINDEXBUCKETS]; d!=NULL; d=d->next){
+        if(d->start == start && d->gen == DIRgen){
+            dirIndexPut(d, entry-IM.map);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&DIlock);
+}
+
+//records that an entry of a directory is no longer used under its name. unless the caller reuses the slot
+//in place (a rename), the slot is also offered to later inserts
+void dirIndexRemove(uint32_t start, char *entry, int reused){
+    pthread_mutex_lock(&DIlock);
+    struct dirindex_t *d;
+    uint64_t off = entry-IM.map;
+    for(d=DI[start%DIRINDEXBUCKETS]; d!=NULL; d=d->next){
+        if(d->start != start || d->gen != DIRgen) continue;
+        uint32_t h = nameHash(entry+27) & d->mask;
+        for(; d->slots[h] != DIRINDEXEMPTY; h=(h+1) & d->mask){
+            if(d->slots[h] == off){
+                d->slots[h] = DIRINDEXREMOVED;
+                if(!reused) dirIndexFree(d, off);
+                break;
+            }
+        }
+        break;
+    }
+    pthread_mutex_unlock(&DIlock);
+}
+
+//finds the directory entry of a file or directory from its absolute path. returns NULL if it doesn't exist
+char *findEntry(char *fp, char *path){
+    uint32_t start = SB.rootstart;
+    uint32_t numblocks = SB.root_block_count;
+    char name[FILENAMELIM];
+    char *entry = NULL;
+    if(path[0] != '/') return NULL;
+    while(path[0] == '/'){
+        path++;
+        int i = 0;
+        while(path[0] != '/' && path[0] != '\0'){
+            if(i == FILENAMELIM-1) return NULL;
+            name[i++] = path[0];
+            path++;
+        }
+        name[i] = '\0';
+        if(i == 0) return entry;
+        entry = dirIndexFind(fp, start, numblocks, name);
+        if(entry == NULL) return NULL;
+        if(path[0] == '/' && !dirNameMatch(entry, name, 0)) return NULL;
+        start = fourbfield(entry, 1);
+        numblocks = fourbfield(entry, 5);
+    }
+    return entry;
+}
+
+//walks numblocks blocks of a FAT chain, or up to its end marker for WHOLECHAIN, and merges consecutive
+//blocks into extents. returns the number of extents, or 0 if the chain is broken or loops
+#define WHOLECHAIN 0xFFFFFFFF
+uint32_t resolveExtents(char *fp, uint32_t start, uint32_t numblocks, struct extent_t **extents){
+    uint32_t cap = 16;
+    uint32_t n = 0;
+    uint32_t block = start;
+    uint32_t i;
+    *extents = try_malloc(cap*sizeof(struct extent_t));
+    for(i=0; i<numblocks; i++){
+        if(block == 0xFFFFFFFF && numblocks == WHOLECHAIN) break;
+        if(block >= SB.block_count || i >= SB.block_count){
+            free(*extents);
+            *extents = NULL;
+            return 0;
+        }
+        if(n > 0 && (*extents)[n-1].start + (*extents)[n-1].count == block){
+            (*extents)[n-1].count++;
+        }else{
+            if(n == cap){
+                cap *= 2;
+                *extents = realloc(*extents, cap*sizeof(struct extent_t));
+                if(*extents == NULL){
+                    perror("Error allocating memory");
+                    exit(1);
+                }
+            }
+            (*extents)[n].start = block;
+            (*extents)[n++].count = 1;
+        }
+        block = fatGet(fp, block);
+    }
+    return n;
+}
+
+//readahead along resolved chains. a chain jumps around the image, so the kernel's sequential readahead
+//can't predict it; instead the extents up to READAHEAD bytes past the copy cursor are announced with
+//posix_fadvise, or with madvise for metadata read through the mapping. --noreadahead turns it off
+#define READAHEAD (8*1024*1024)
+int prefetching = 1;
+
+struct readahead_t{
+    struct extent_t *extents;
+    uint32_t n;
+    uint32_t next;//first extent not completely hinted yet
+    int64_t nextoff;//bytes of it already hinted
+    int64_t hinted;//bytes hinted from the cursor's starting point
+    int mapped;
+};
+
+//asks the kernel to start reading a byte range of the image
+void hintRange(int64_t off, int64_t len, int mapped){
+    if(mapped && !WM.enabled){
+        long page = sysconf(_SC_PAGESIZE);
+        int64_t start = off/page*page;
+        madvise(IM.map+start, len+off-start, MADV_WILLNEED);
+    }else{
+        posix_fadvise(IM.fd, off, len, POSIX_FADV_WILLNEED);
+    }
+}
+
+//starts a readahead window at byte skip of extent first
+void readaheadInit(struct readahead_t *ra, struct extent_t *extents, uint32_t n, uint32_t first, int64_t skip, int mapped){
+    ra->extents = extents;
+    ra->n = n;
+    ra->next = first;
+    ra->nextoff = skip;
+    ra->hinted = 0;
+    ra->mapped = mapped;
+}
+
+//slides the window once done bytes have been consumed, hinting what lies less than READAHEAD bytes ahead
+void readaheadAdvance(struct readahead_t *ra, int64_t done){
+    if(!prefetching) return;
+    while(ra->next < ra->n && ra->hinted < done+READAHEAD){
+        int64_t left = (int64_t)ra->extents[ra->next].count*SB.block_size - ra->nextoff;
+        int64_t len = done+READAHEAD-ra->hinted;
+        if(len > left) len = left;
+        hintRange((int64_t)ra->extents[ra->next].start*SB.block_size + ra->nextoff, len, ra->mapped);
+        ra->hinted += len;
+        ra->nextoff += len;
+        if(ra->nextoff == (int64_t)ra->extents[ra->next].count*SB.block_size){
+            ra->next++;
+            ra->nextoff = 0;
+        }
+    }
+}
+
+//an open file in the image. its extent index is built from the FAT on the first read, and it owns
+//its own copy so nothing another open does to the cache can pull it out from under a read
+struct diskfile_t{
+    uint32_t start;
+    uint32_t size;
+    uint32_t nextents;
+    struct extent_t *extents;
+    uint64_t *offsets;
+};
+
+//chain indexes kept between opens of the same file, looked up by start block. IClock guards every slot
+#define INDEXCACHESIZE 64
+struct indexcache_t{
+    uint32_t start;
+    uint32_t size;
+    uint64_t gen;
+    uint32_t nextents;
+    struct extent_t *extents;
+    uint64_t *offsets;
+};
+
+struct indexcache_t IC[INDEXCACHESIZE];
+pthread_mutex_t IClock = PTHREAD_MUTEX_INITIALIZER;
+
+//opens a file in the image by its absolute path. returns NULL if it doesn't exist or is a directory
+struct diskfile_t *diskOpen(char *fp, char *path){
+    char *entry = findEntry(fp, path);
+    if(entry == NULL || !fileNameMatch(entry, entry+27, 0)) return NULL;
+    struct diskfile_t *f = try_malloc(sizeof(struct diskfile_t));
+    f->start = fourbfield(entry, 1);
+    f->size = fourbfield(entry, 9);
+    f->nextents = 0;
+    f->extents = NULL;
+    f->offsets = NULL;
+    return f;
+}
+
+//closes a file opened with diskOpen. its index stays in the cache
+void diskClose(struct diskfile_t *f){
+    free(f->extents);
+    free(f->offsets);
+    free(f);
+}
+
+//builds the extent index of a file, or takes it from the cache if the FAT hasn't changed since.
+//returns 0 if the file's chain is broken
+int diskIndex(char *fp, struct diskfile_t *f){
+    if(f->nextents > 0 || f->size == 0) return 1;
+    struct indexcache_t *c = &IC[f->start%INDEXCACHESIZE];
+    pthread_mutex_lock(&IClock);
+    if(c->extents == NULL || c->start != f->start || c->size != f->size || c->gen != FATgen){
+        uint32_t needed = f->size/SB.block_size + (f->size%SB.block_size == 0 ? 0 : 1);
+        struct extent_t *extents;
+        uint32_t n = resolveExtents(fp, f->start, needed, &extents);
+        if(n == 0){
+            pthread_mutex_unlock(&IClock);
+            return 0;
+        }
+        free(c->extents);
+        free(c->offsets);
+        c->start = f->start;
+        c->size = f->size;
+        c->gen = FATgen;
+        c->nextents = n;
+        c->extents = extents;
+        c->offsets = try_malloc(n*sizeof(uint64_t));
+        uint64_t off = 0;
+        uint32_t i;
+        for(i=0; i<n; i++){
+            c->offsets[i] = off;
+            off += (uint64_t)extents[i].count*SB.block_size;
+        }
+    }
+    f->extents = try_malloc(c->nextents*sizeof(struct extent_t));
+    f->offsets = try_malloc(c->nextents*sizeof(uint64_t));
+    memcpy(f->extents, c->extents, c->nextents*sizeof(struct extent_t));
+    memcpy(f->offsets, c->offsets, c->nextents*sizeof(uint64_t));
+    f->nextents = c->nextents;
+    pthread_mutex_unlock(&IClock);
+    return 1;
+}
+
+//returns the extent holding byte off of the file by binary search over the extent offsets
+uint32_t diskSeek(struct diskfile_t *f, uint64_t off){
+    uint32_t lo = 0, hi = f->nextents-1;
+    while(lo < hi){
+        uint32_t mid = (lo+hi+1)/2;
+        if(f->offsets[mid] <= off){
+            lo = mid;
+        }else{
+            hi = mid-1;
+        }
+    }
+    return lo;
+}
+
+//reads up to len bytes from offset off of the file, like pread. returns the number of bytes read or -1 if the chain is broken
+int64_t diskRead(char *fp, struct diskfile_t *f, uint64_t off, char *buf, uint64_t len){
+    if(off >= f->size) return 0;
+    if(len > f->size-off) len = f->size-off;
+    if(!diskIndex(fp, f)) return -1;
+    uint32_t i = diskSeek(f, off);
+    uint32_t first = i;
+    uint64_t done = 0;
+    int nreqs = 0;
+    struct ioreq_t *reqs = try_malloc((len/IOCHUNK+f->nextents-first+1)*sizeof(struct ioreq_t));
+    while(done < len){//the pieces of every extent the range covers are issued together
+        uint64_t inext = off+done-f->offsets[i];
+        uint64_t n = (uint64_t)f->extents[i].count*SB.block_size - inext;
+        if(n > len-done) n = len-done;
+        uint64_t piece;
+        for(piece=0; piece<n; piece+=IOCHUNK){
+            reqs[nreqs].buf = buf+done+piece;
+            reqs[nreqs].off = (uint64_t)f->extents[i].start*SB.block_size+inext+piece;
+            reqs[nreqs++].len = n-piece < IOCHUNK ? n-piece : IOCHUNK;
+        }
+        done += n;
+        i++;
+    }
+    int phase = statsPhase(PHASETRANSFER);
+    int failed = IO->read(reqs, nreqs);
+    statsPhase(phase);
+    STAT(blocks, (done+SB.block_size-1)/SB.block_size);
+    free(reqs);
+    return failed ? -1 : (int64_t)done;
+}
+
+//free space index decoded from the FAT. a set bit in bits marks a free block,
+//a set bit in summary marks a word of bits that still holds a free block
+struct freemap_t{
+    uint64_t *bits;
+    uint64_t *summary;
+    uint32_t nblocks;
+    uint32_t nwords;
+    uint32_t nsummary;
+    uint32_t first;
+    uint32_t cursor;
+};
+
+//block allocation policies for diskput
+#define FIRSTFIT 0
+#define BESTFIT 1
+#define NEXTFIT 2
+
+struct freemap_t FM;
+int allocpolicy = BESTFIT;
+
+void buildFreeMap(char *fp);
+
+//marks a block as free or claimed in the free space index
+void freemapSet(uint32_t block, int isfree){
+    uint32_t w = block/64;
+    if(isfree){
+        FM.bits[w] |= 1ULL<<(block%64);
+    }else{
+        FM.bits[w] &= ~(1ULL<<(block%64));
+    }
+    if(FM.bits[w] != 0){
+        FM.summary[w/64] |= 1ULL<<(w%64);
+    }else{
+        FM.summary[w/64] &= ~(1ULL<<(w%64));
+    }
+}
+
+//returns the first free block at or after from, or FM.nblocks if there is none
+uint32_t freemapNext(uint32_t from){
+    if(from >= FM.nblocks) return FM.nblocks;
+    uint32_t w = from/64;
+    uint64_t word = FM.bits[w] & (~0ULL<<(from%64));
+    if(word != 0) return w*64 + __builtin_ctzll(word);
+    w++;
+    uint32_t s = w/64;
+    if(s >= FM.nsummary) return FM.nblocks;
+    uint64_t sword = FM.summary[s] & (~0ULL<<(w%64));
+    while(sword == 0){
+        if(++s >= FM.nsummary) return FM.nblocks;
+        sword = FM.summary[s];
+    }
+    w = s*64 + __builtin_ctzll(sword);
+    return w*64 + __builtin_ctzll(FM.bits[w]);
+}
+
+//returns how many free blocks follow start contiguously, up to max
+uint32_t freemapRun(uint32_t start, uint32_t max){
+    uint32_t len = 0;
+    while(len < max && start+len < FM.nblocks){
+        uint32_t b = start+len;
+        uint64_t used = ~FM.bits[b/64]>>(b%64);
+        uint32_t n = used == 0 ? 64-b%64 : __builtin_ctzll(used);
+        len += n;
+        if(n < 64-b%64) break;
+    }
+    return len < max ? len : max;
+}
+
+//runs of blocks freed since the last commit, to be punched out of the image file once it is durable
+struct punch_t{
+    int enabled;
+    struct extent_t *runs;
+    uint32_t n;
+    uint32_t cap;
+};
+struct punch_t PH;
+
+//adds a freed run to the punch list, growing the last run when it follows on from it
+void punchAdd(uint32_t start, uint32_t count){
+    if(PH.n > 0 && PH.runs[PH.n-1].start+PH.runs[PH.n-1].count == start){
+        PH.runs[PH.n-1].count += count;
+        return;
+    }
+    if(PH.n == PH.cap){
+        PH.cap = PH.cap ? PH.cap*2 : 64;
+        PH.runs = realloc(PH.runs, PH.cap*sizeof(struct extent_t));
+        if(PH.runs == NULL){
+            perror("Error allocating memory");
+            exit(1);
+        }
+    }
+    PH.runs[PH.n].start = start;
+    PH.runs[PH.n++].count = count;
+}
+
+//orders extents by their first block
+int extentCompare(const void *a, const void *b){
+    uint32_t x = ((struct extent_t *)a)->start, y = ((struct extent_t *)b)->start;
+    return x < y ? -1 : x > y;
+}
+
+//deallocates the freed runs in the image file with FALLOC_FL_PUNCH_HOLE so the image stays sparse. runs
+//are merged and trimmed to whole filesystem blocks, since a partial block would only be zeroed.
+//must run after the commit that freed them, or a crash could leave live data punched out, and before
+//the blocks can be claimed again
+void punchHoles(void){
+    if(PH.n == 0) return;
+    struct stat sf;
+    fstat(IM.fd, &sf);
+    int64_t unit = sf.st_blksize > 0 ? sf.st_blksize : 4096;
+    uint32_t i = 0, j;
+    qsort(PH.runs, PH.n, sizeof(struct extent_t), extentCompare);
+    while(i < PH.n){
+        uint32_t end = PH.runs[i].start+PH.runs[i].count;
+        for(j=i+1; j<PH.n && PH.runs[j].start <= end; j++){
+            if(PH.runs[j].start+PH.runs[j].count > end) end = PH.runs[j].start+PH.runs[j].count;
+        }
+        int64_t from = ((int64_t)PH.runs[i].start*SB.block_size+unit-1)/unit*unit;
+        int64_t to = (int64_t)end*SB.block_size/unit*unit;
+        if(to > from && fallocate(IM.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from, to-from) < 0){
+            perror("Can't punch holes in image");
+            break;
+        }
+        i = j;
+    }
+    PH.n = 0;
+}
+
+//returns the first block of the free run holding the free block b
+uint32_t freemapRunStart(uint32_t b){
+    uint32_t w = b/64;
+    uint64_t used = ~FM.bits[w] & ((2ULL<<(b%64))-1);
+    while(used == 0){
+        if(w == 0) return 0;
+        used = ~FM.bits[--w];
+    }
+    return w*64 + 64-__builtin_clzll(used);
+}
+
+//free runs indexed by length for best-fit, so a claim doesn't walk every free run. runs shorter than 64
+//blocks have a bucket per length and longer ones a bucket per power of two. entries are added whenever a
+//run is split or merged and the old ones are dropped lazily: an entry only counts while its run is still
+//free and exactly that long. built by the first best-fit claim and kept up to date by claimAt and returnRun
+#define RUNCLASSES 90
+struct runbucket_t{
+    struct extent_t *runs;
+    uint32_t n;
+    uint32_t cap;
+};
+
+struct runindex_t{
+    int built;
+    struct runbucket_t buckets[RUNCLASSES];
+};
+
+struct runindex_t RI;
+
+//bucket of a run length
+uint32_t runClass(uint32_t len){
+    if(len < 64) return len;
+    return 64 + (31-__builtin_clz(len)) - 6;
+}
+
+//records a free run in its bucket
+void runIndexAdd(uint32_t start, uint32_t len){
+    if(!RI.built || len == 0) return;
+    struct runbucket_t *b = &RI.buckets[runClass(len)];
+    if(b->n == b->cap){
+        b->cap = b->cap ? b->cap*2 : 64;
+        b->runs = realloc(b->runs, b->cap*sizeof(struct extent_t));
+        if(b->runs == NULL){
+            perror("Error allocating memory");
+            exit(1);
+        }
+    }
+    b->runs[b->n].start = start;
+    b->runs[b->n++].count = len;
+}
+
+//whether a recorded run is still a whole free run of that length
+int runCurrent(struct extent_t *r){
+    if(r->start > 0 && (FM.bits[(r->start-1)/64]>>((r->start-1)%64) & 1)) return 0;
+    return freemapRun(r->start, r->count+1) == r->count;
+}
+
+//indexes every free run of the free map
+void runIndexBuild(void){
+    RI.built = 1;
+    uint32_t start = freemapNext(0);
+    while(start < FM.nblocks){
+        uint32_t run = freemapRun(start, FM.nblocks);
+        runIndexAdd(start, run);
+        start = freemapNext(start+run);
+    }
+}
+
+//forgets the index, for when the free map was changed behind its back
+void runIndexDrop(void){
+    int c;
+    for(c=0; c<RUNCLASSES; c++){
+        free(RI.buckets[c].runs);
+    }
+    memset(&RI, 0, sizeof(RI));
+}
+
+//returns a current run of a bucket of runs of one length, or NULL if it has none
+struct extent_t *runBucketTop(struct runbucket_t *b){
+    while(b->n > 0 && !runCurrent(&b->runs[b->n-1])) b->n--;
+    return b->n > 0 ? &b->runs[b->n-1] : NULL;
+}
+
+//looks through a bucket for its shortest run of at least want blocks, or its longest run when longest is
+//set, dropping the entries that are out of date. returns 0 if there is none
+uint32_t runBucketBest(struct runbucket_t *b, uint32_t want, int longest, uint32_t *start){
+    uint32_t i = 0, bestlen = 0;
+    while(i < b->n){
+        struct extent_t *r = &b->runs[i];
+        if(!runCurrent(r)){
+            *r = b->runs[--b->n];
+            continue;
+        }
+        if(longest ? r->count > bestlen : r->count >= want && (bestlen == 0 || r->count < bestlen)){
+            *start = r->start;
+            bestlen = r->count;
+        }
+        i++;
+    }
+    return bestlen;
+}
+
+//marks count free blocks from start as claimed
+void claimAt(uint32_t start, uint32_t count){
+    uint32_t i;
+    if(PH.n > 0 && !JN.enabled) punchHoles();//without the journal freed blocks can be claimed straight away
+    for(i=0; i<count; i++){
+        freemapSet(start+i, 0);
+    }
+    if(RI.built){//whatever is left of the run on either side
+        if(start > 0 && (FM.bits[(start-1)/64]>>((start-1)%64) & 1)){
+            uint32_t left = freemapRunStart(start-1);
+            runIndexAdd(left, start-left);
+        }
+        if(start+count < FM.nblocks) runIndexAdd(start+count, freemapRun(start+count, FM.nblocks));
+    }
+    FB.available -= count;
+    FB.allocated += count;
+}
+
+//returns count blocks from start to the free space index straight away
+void returnRun(uint32_t start, uint32_t count){
+    uint32_t i;
+    for(i=0; i<count; i++){
+        freemapSet(start+i, 1);
+    }
+    if(RI.built){//the run they merge into
+        uint32_t first = freemapRunStart(start);
+        runIndexAdd(first, start+count-first + freemapRun(start+count, FM.nblocks));
+    }
+    if(start < FM.first) FM.first = start;
+    FB.available += count;
+    FB.allocated -= count;
+}
+
+//returns count blocks from start to the free space index. the caller clears their FAT entries.
+//with the journal on they only become free once the transaction that freed them commits
+void releaseRun(uint32_t start, uint32_t count){
+    if(PH.enabled) punchAdd(start, count);
+    if(!JN.enabled){
+        returnRun(start, count);
+        return;
+    }
+    if(JN.nfreed+2 > JN.freedcap){
+        JN.freedcap = JN.freedcap ? JN.freedcap*2 : 64;
+        uint32_t *grown = try_malloc(JN.freedcap*sizeof(uint32_t));
+        if(JN.nfreed > 0) memcpy(grown, JN.freed, JN.nfreed*sizeof(uint32_t));
+        free(JN.freed);
+        JN.freed = grown;
+    }
+    JN.freed[JN.nfreed++] = start;
+    JN.freed[JN.nfreed++] = count;
+}
+
+//finds the smallest free run that holds want blocks, or the largest run if none is big enough
+uint32_t bestFitRun(uint32_t want, uint32_t *len){
+    uint32_t best = FM.nblocks;
+    struct extent_t *r;
+    int c;
+    if(!RI.built) runIndexBuild();
+    for(c=runClass(want); c<RUNCLASSES; c++){
+        if(c < 64 && (r = runBucketTop(&RI.buckets[c])) != NULL){
+            *len = r->count;
+            return r->start;
+        }
+        if(c >= 64 && (*len = runBucketBest(&RI.buckets[c], want, 0, &best)) > 0) return best;
+    }
+    for(c=RUNCLASSES-1; c>0; c--){//nothing is big enough, so the longest run
+        if(c < 64 && (r = runBucketTop(&RI.buckets[c])) != NULL){
+            *len = r->count;
+            return r->start;
+        }
+        if(c >= 64 && (*len = runBucketBest(&RI.buckets[c], 0, 1, &best)) > 0) return best;
+    }
+    *len = 0;
+    return FM.nblocks;
+}
+
+//claims up to want contiguous blocks according to the allocation policy. returns the first block of the run
+//first-fit: the lowest free blocks. best-fit: the tightest run that holds everything. next-fit: the next free blocks after the cursor
+uint32_t claimRun(uint32_t want, uint32_t *got){
+    if(FM.bits == NULL) buildFreeMap(IM.map);
+    uint32_t start;
+    if(allocpolicy == BESTFIT){
+        start = bestFitRun(want, got);
+    }else{
+        start = freemapNext(allocpolicy == NEXTFIT ? FM.cursor : FM.first);
+        if(start >= FM.nblocks) start = freemapNext(FM.first);
+        *got = start < FM.nblocks ? freemapRun(start, want) : 0;
+    }
+    if(start >= FM.nblocks){
+        fprintf(stderr, "Not enough free space on disk.\n");
+        exit(1);
+    }
+    if(*got > want) *got = want;
+    claimAt(start, *got);
+    if(allocpolicy == FIRSTFIT) FM.first = start + *got;
+    FM.cursor = start + *got;
+    return start;
+}
+
+//claims a single free block
+uint32_t claimBlock(void){
+    uint32_t got;
+    return claimRun(1, &got);
+}
+
+//decodes the FAT into the free space index
+void buildFreeMap(char *fp){
+    uint32_t entries = (int64_t)SB.FATblocks*SB.block_size/4;
+    FM.nblocks = SB.block_count < entries ? SB.block_count : entries;
+    FM.nwords = (FM.nblocks+63)/64;
+    FM.nsummary = (FM.nwords+63)/64;
+    FM.bits = try_malloc(FM.nwords*sizeof(uint64_t));
+    FM.summary = try_malloc(FM.nsummary*sizeof(uint64_t));
+    memset(FM.bits, 0, FM.nwords*sizeof(uint64_t));
+    memset(FM.summary, 0, FM.nsummary*sizeof(uint64_t));
+    FM.first = 0;
+    long FS = (long)SB.block_size*SB.FATstart;
+    uint32_t i;
+    for(i=0; i<FM.nblocks; i++){
+        if(fourbfield(fp, FS+4*i) == 0) freemapSet(i, 1);
+    }
+}
+
+//a unit of work for the worker pool. run gets the index of the worker running it
+struct task_t{
+    void (*run)(void *arg, int worker);
+    void *arg;
+};
+
+//a worker's deque. the owner pushes and pops at the bottom, idle workers steal from the top
+struct deque_t{
+    pthread_mutex_t lock;
+    struct task_t *tasks;
+    long top;
+    long bottom;
+    long cap;
+};
+
+//work-stealing pool of threads. pending counts tasks queued or running, and the pool is
+//done when it reaches 0 since a task always queues its children before it finishes
+struct pool_t{
+    int nworkers;
+    struct deque_t *queues;
+    long pending;
+};
+
+struct pool_t POOL;
+int nthreads = 0;
+
+//creates the deques for --threads workers, or one per online cpu
+void poolInit(void){
+    int i;
+    POOL.nworkers = nthreads > 0 ? nthreads : sysconf(_SC_NPROCESSORS_ONLN);
+    if(POOL.nworkers < 1) POOL.nworkers = 1;
+    POOL.queues = try_malloc(POOL.nworkers*sizeof(struct deque_t));
+    for(i=0; i<POOL.nworkers; i++){
+        pthread_mutex_init(&POOL.queues[i].lock, NULL);
+        POOL.queues[i].cap = 64;
+        POOL.queues[i].tasks = try_malloc(64*sizeof(struct task_t));
+        POOL.queues[i].top = 0;
+        POOL.queues[i].bottom = 0;
+    }
+    POOL.pending = 0;
+}
+
+//queues a task on a worker's deque
+void poolSubmit(int worker, void (*run)(void *, int), void *arg){
+    struct deque_t *q = &POOL.queues[worker];
+    __atomic_fetch_add(&POOL.pending, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_lock(&q->lock);
+    if(q->bottom-q->top == q->cap){
+        struct task_t *grown = try_malloc(2*q->cap*sizeof(struct task_t));
+        long i;
+        for(i=q->top; i<q->bottom; i++){
+            grown[i%(2*q->cap)] = q->tasks[i%q->cap];
+        }
+        free(q->tasks);
+        q->tasks = grown;
+        q->cap *= 2;
+    }
+    q->tasks[q->bottom%q->cap].run = run;
+    q->tasks[q->bottom%q->cap].arg = arg;
+    q->bottom++;
+    pthread_mutex_unlock(&q->lock);
+}
+
+//takes a task from the bottom of a deque, or from the top when stealing. returns 0 if it was empty
+int dequeTake(struct deque_t *q, struct task_t *t, int steal){
+    int found = 0;
+    pthread_mutex_lock(&q->lock);
+    if(q->bottom > q->top){
+        if(steal){
+            *t = q->tasks[q->top%q->cap];
+            q->top++;
+        }else{
+            q->bottom--;
+            *t = q->tasks[q->bottom%q->cap];
+        }
+        found = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+//runs tasks from its own deque and steals from the others until no task is left anywhere
+void *poolWorker(void *arg){
+    int me = (int)(long)arg;
+    struct task_t t;
+    int i;
+    while(__atomic_load_n(&POOL.pending, __ATOMIC_ACQUIRE) > 0){
+        int found = dequeTake(&POOL.queues[me], &t, 0);
+        for(i=1; !found && i<POOL.nworkers; i++){
+            found = dequeTake(&POOL.queues[(me+i)%POOL.nworkers], &t, 1);
+        }
+        if(found){
+            t.run(t.arg, me);
+            __atomic_fetch_sub(&POOL.pending, 1, __ATOMIC_ACQ_REL);
+        }else{
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+//runs the queued tasks and everything they queue. the calling thread works as worker 0
+void poolRun(void){
+    pthread_t *threads = try_malloc(POOL.nworkers*sizeof(pthread_t));
+    long i;
+    for(i=1; i<POOL.nworkers; i++){
+        pthread_create(&threads[i], NULL, poolWorker, (void *)i);
+    }
+    poolWorker((void *)0);
+    for(i=1; i<POOL.nworkers; i++){
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+//marks a block in a bitmap shared by the pool's workers. returns 0 if it was already marked
+int visitMark(uint64_t *bits, uint32_t block){
+    uint64_t bit = 1ULL << (block%64);
+    return !(__atomic_fetch_or(&bits[block/64], bit, __ATOMIC_RELAXED) & bit);
+}
+
+//first blocks of the directories a walk of the tree has entered. a corrupt image can link a directory
+//back to one of its ancestors, and a walk that doesn't notice goes round forever
+uint64_t *VISITED = NULL;
+
+//starts a walk with no directory entered
+void visitInit(void){
+    long words = ((long)SB.block_count+63)/64;
+    free(VISITED);
+    VISITED = try_malloc(words*sizeof(uint64_t));
+    memset(VISITED, 0, words*sizeof(uint64_t));
+}
+
+//marks a directory as entered by the walk. returns 0 if it was entered before
+int visitDir(uint32_t start){
+    return start >= SB.block_count || visitMark(VISITED, start);
+}
+
+//stops a walk that came back to a directory it had already entered
+void dirCycle(char *path){
+    fprintf(stderr, "%s: directory loops back to one of its parents, run diskcheck --repair.\n", path);
+    exit(1);
+}
+
+#if defined(PART4)
+//helper function to set a struct to the current time
+void getCurrentTime(struct datetime_t *timeb){
+    struct tm *UTCtime;
+    time_t now = time(0);
+    UTCtime = gmtime(&now);
+    timeb->sec = (UTCtime->tm_sec);
+    timeb->min = (UTCtime->tm_min);
+    timeb->hour = (UTCtime->tm_hour);
+    timeb->day = (UTCtime->tm_mday);
+    timeb->month = (UTCtime->tm_mon+1);
+    timeb->year = ((UTCtime->tm_year+1900));
+}
+
+//writes a directory entry with the current time as both its create and modify time
+void writeEntry(char *entry, uint8_t status, uint32_t start, uint32_t numblocks, uint32_t size, char *name){
+    struct datetime_t timeb;
+    getCurrentTime(&timeb);
+    uint32_t startingblock = htonl(start);
+    uint32_t numberofblocks = htonl(numblocks);
+    uint32_t filesize = htonl(size);
+    uint16_t year = htons(timeb.year);
+    journalTouch(entry, 64);
+    memcpy(entry, &status, 1);
+    memcpy(entry+1, &startingblock, 4);
+    memcpy(entry+5, &numberofblocks, 4);
+    memcpy(entry+9, &filesize, 4);
+    memcpy(entry+13, &year, 2);
+    memcpy(entry+15, &(timeb.month), 1);
+    memcpy(entry+16, &(timeb.day), 1);
+    memcpy(entry+17, &(timeb.hour), 1);
+    memcpy(entry+18, &(timeb.min), 1);
+    memcpy(entry+19, &(timeb.sec), 1);
+    memcpy(entry+20, &year, 2);
+    memcpy(entry+22, &(timeb.month), 1);
+    memcpy(entry+23, &(timeb.day), 1);
+    memcpy(entry+24, &(timeb.hour), 1);
+    memcpy(entry+25, &(timeb.min), 1);
+    memcpy(entry+26, &(timeb.sec), 1);
+    memset(entry+27, 0, FILENAMELIM);
+    memcpy(entry+27, name, strlen(name));
+    memset(entry+58, 0xFF, 6);
+}
+
+//clears a block that is becoming part of a directory. the unused tail of every entry is 0xFF
+void initDirBlock(char *fp, uint32_t block){
+    char *dir = fp+(long)block*SB.block_size;
+    int ndx;
+    journalTouch(dir, SB.block_size);
+    memset(dir, 0, SB.block_size);
+    for(ndx=0; ndx+64<=SB.block_size; ndx+=64){
+        memset(dir+ndx+58, 0xFF, 6);
+    }
+}
+
+//finds count free entry slots in a directory, taking them from its index. when there aren't enough the
+//directory is extended by all the blocks still needed at once. sizeloc is the offset of the directory's
+//block count (26 for the root), which is followed by its size
+void dirSlots(char *fp, long sizeloc, uint32_t start, uint32_t numblocks, uint32_t count, char **slots){
+    pthread_mutex_lock(&DIlock);
+    struct dirindex_t *d = dirIndexGet(fp, start, numblocks);
+    uint32_t found = 0;
+    while(found < count && d->freehead < d->nfree){
+        slots[found++] = fp+d->free[d->freehead++];
+    }
+    if(found < count){
+        if(d->last >= SB.block_count){
+            fprintf(stderr, "Corrupt directory.\n");
+            exit(1);
+        }
+        uint32_t perblock = SB.block_size/64;
+        uint32_t want = (count-found+perblock-1)/perblock;
+        uint32_t added = 0;
+        while(added < want){
+            uint32_t got;
+            uint32_t run = claimRun(want-added, &got);
+            uint32_t i, ndx;
+            for(i=0; i<got; i++){
+                initDirBlock(fp, run+i);
+                fatSet(fp, d->last, run+i);//link the new block after the old directory ending
+                d->last = run+i;
+                for(ndx=0; ndx+64<=SB.block_size; ndx+=64){
+                    if(found < count) slots[found++] = fp+(long)(run+i)*SB.block_size+ndx;
+                    else dirIndexFree(d, (long)(run+i)*SB.block_size+ndx);
+                }
+            }
+            added += got;
+        }
+        fatSet(fp, d->last, 0xFFFFFFFF);//new directory ending
+        journalTouch(fp+sizeloc, 8);
+        uint32_t temp = htonl(fourbfield(fp, sizeloc)+added);
+        memcpy(fp+sizeloc, &temp, 4);//extend num blocks
+        temp = htonl(fourbfield(fp, sizeloc+4)+added*SB.block_size);
+        memcpy(fp+sizeloc+4, &temp, 4);//extend filesize
+    }
+    pthread_mutex_unlock(&DIlock);
+}
+
+//returns a free entry slot in a directory. when every slot is taken the directory is extended by one block
+char *freeDirSlot(char *fp, long sizeloc, uint32_t start, uint32_t numblocks){
+    char *entry;
+    dirSlots(fp, sizeloc, start, numblocks, 1, &entry);
+    return entry;
+}
+
+//updates directory entries for inserting a new file. creates subdirectories if they don't exist. Extends parent directories if they are full.
+void writeDirInfo(char *fp, char *dirname, long prevnumblocks, uint32_t start, uint32_t numblocks, uint32_t newstartblock, uint32_t newsize){
+    if(dirname[0] != '/'){
+        fprintf(stderr, "Input format: /subdir/subdir/filename\n");
+        exit(1);
+    }
+    dirname++;
+    if(dirname[0] == '\0'){
+        fprintf(stderr, "Input format: /subdir/subdir/filename\n");
+        exit(1);
+    }
+    int i = 0;
+    char tempbuf[FILENAMELIM];
+    while(dirname[0] != '/' && dirname[0] != '\0'){//get current directory or filename
+        if(i == FILENAMELIM-1){
+            fprintf(stderr, "Name too long.\n");
+            exit(1);
+        }
+        tempbuf[i++] = dirname[0];
+        dirname++;
+    }
+    tempbuf[i] = '\0';
+    char *entry = dirIndexFind(fp, start, numblocks, tempbuf);
+    if(dirname[0] == '\0'){//file
+        if(entry != NULL){
+            fprintf(stderr, "file already exists.");
+            exit(1);
+        }
+        uint32_t blocks = newsize/SB.block_size + (newsize%SB.block_size == 0 ? 0 : 1);
+        entry = freeDirSlot(fp, prevnumblocks, start, numblocks);
+        writeEntry(entry, 3, newstartblock, blocks, newsize, tempbuf);
+        dirIndexAdd(start, entry);
+    }else{//directory
+        if(entry != NULL && dirNameMatch(entry, tempbuf, 0)){//directory exists
+            writeDirInfo(fp, dirname, entry-fp+5, fourbfield(entry, 1), fourbfield(entry, 5), newstartblock, newsize);
+            return;
+        }
+        if(entry != NULL){
+            fprintf(stderr, "file already exists.");
+            exit(1);
+        }
+        uint32_t startblk = claimBlock();//find a place to put new directory
+        initDirBlock(fp, startblk);
+        fatSet(fp, startblk, 0xFFFFFFFF);
+        entry = freeDirSlot(fp, prevnumblocks, start, numblocks);
+        writeEntry(entry, 5, startblk, 1, SB.block_size, tempbuf);
+        dirIndexAdd(start, entry);
+        writeDirInfo(fp, dirname, entry-fp+5, startblk, 1, newstartblock, newsize);
+    }
+}
+
+//size of the buffer diskput reads its input through
+#define PUTCHUNK (1<<20)
+
+//clears the FAT entries of a chain and returns its blocks to the free space index
+void freeChain(char *fp, uint32_t start){
+    uint32_t block = start;
+    uint32_t next, i, runstart = 0, runlen = 0;
+    for(i=0; block != 0 && block < SB.block_count && i < SB.block_count; i++){
+        next = fatGet(fp, block);
+        fatSet(fp, block, 0);
+        if(runlen > 0 && runstart+runlen == block){
+            runlen++;
+        }else{
+            if(runlen > 0) releaseRun(runstart, runlen);
+            runstart = block;
+            runlen = 1;
+        }
+        block = next;
+    }
+    if(runlen > 0) releaseRun(runstart, runlen);
+}
+
+//streams an open input onto the disk. blocks are claimed and linked into the FAT chain as the data arrives,
+//so memory use doesn't depend on the file size. known is the input size, or -1 when it can't be known
+//in advance. after is the block the new chain will be linked behind, or 0xFFFFFFFF, and the free blocks
+//following it are used first. returns the first block of the chain and the file size, block count and extent count
+uint32_t writeChain(char *fp, int ifp, int64_t known, char *buf, long chunk, int64_t *size, uint32_t *blocks, uint32_t *extents, uint32_t after){
+    struct ioreq_t *reqs = try_malloc((chunk/SB.block_size+1)*sizeof(struct ioreq_t));
+    int nreqs;
+    uint32_t first = 0xFFFFFFFF;
+    uint32_t prev = 0xFFFFFFFF;
+    uint32_t runstart = after+1, runlen = 0, runused = 0;//an empty run ending where the new blocks should go
+    if(FM.bits == NULL) buildFreeMap(fp);
+    uint32_t fileblocks = 0, runs = 0;
+    int64_t filesize = 0;
+    long n;
+    int phase = statsPhase(PHASETRANSFER);
+    while((n = readFull(ifp, buf, chunk)) > 0){
+        if(filesize + n > 0xFFFFFFFFLL){
+            if(prev != 0xFFFFFFFF) fatSet(fp, prev, 0xFFFFFFFF);
+            freeChain(fp, first);
+            fprintf(stderr, "File too large.\n");
+            exit(1);
+        }
+        long off = 0;
+        nreqs = 0;
+        while(off < n){
+            if(runused == runlen){
+                //the rest of the file when its size is known, or else the rest of this chunk
+                int64_t left = known > filesize+off ? known-filesize-off : n-off;
+                uint32_t want = left/SB.block_size + (left%SB.block_size == 0 ? 0 : 1);
+                uint32_t more = runstart+runlen < FM.nblocks ? freemapRun(runstart+runlen, want) : 0;
+                if(more > 0){//keep growing the current run while the blocks after it are free
+                    claimAt(runstart+runlen, more);
+                    runlen += more;
+                }else{
+                    runstart = claimRun(want, &runlen);
+                    runused = 0;
+                }
+            }
+            uint32_t block = runstart + runused++;
+            long len = n-off < SB.block_size ? n-off : SB.block_size;
+            if(nreqs > 0 && block == prev+1){//contiguous blocks of the chunk go out as one write
+                reqs[nreqs-1].len += len;
+            }else{
+                reqs[nreqs].buf = buf+off;
+                reqs[nreqs].off = (long)block*SB.block_size;
+                reqs[nreqs++].len = len;
+            }
+            if(prev == 0xFFFFFFFF){
+                first = block;
+            }else{
+                fatSet(fp, prev, block);
+            }
+            if(block != prev+1) runs++;
+            prev = block;
+            fileblocks++;
+            off += len;
+        }
+        if(IO->write(reqs, nreqs) < 0){
+            perror("Error writing image");
+            exit(1);
+        }
+        filesize += n;
+        STAT(bytes, n);
+    }
+    statsPhase(phase);
+    STAT(blocks, fileblocks);
+    free(reqs);
+    if(prev != 0xFFFFFFFF) fatSet(fp, prev, 0xFFFFFFFF);
+    if(runused < runlen) releaseRun(runstart+runused, runlen-runused);
+    if(n < 0){
+        freeChain(fp, first);
+        fprintf(stderr, "Can't read file.\n");
+        exit(1);
+    }
+    *size = filesize;
+    *blocks = fileblocks;
+    *extents = runs;
+    return first;
+}
+
+//size of the chunks input is streamed through for a block size
+long putChunk(void){
+    return PUTCHUNK < SB.block_size ? SB.block_size : PUTCHUNK/SB.block_size*SB.block_size;
+}
+
+//what diskput does when the file already exists: fail, add the input to its end, or make it the input
+#define PUTNEW 0
+#define PUTAPPEND 1
+#define PUTUPDATE 2
+int putmode = PUTNEW;
+
+//sets a file entry's chain and size after its data changed, with the current time as its modify time
+void updateEntry(char *entry, uint32_t start, uint32_t size){
+    struct datetime_t timeb;
+    getCurrentTime(&timeb);
+    uint32_t startingblock = htonl(start);
+    uint32_t numberofblocks = htonl(size/SB.block_size + (size%SB.block_size == 0 ? 0 : 1));
+    uint32_t filesize = htonl(size);
+    uint16_t year = htons(timeb.year);
+    journalTouch(entry, 64);
+    memcpy(entry+1, &startingblock, 4);
+    memcpy(entry+5, &numberofblocks, 4);
+    memcpy(entry+9, &filesize, 4);
+    memcpy(entry+20, &year, 2);
+    memcpy(entry+22, &(timeb.month), 1);
+    memcpy(entry+23, &(timeb.day), 1);
+    memcpy(entry+24, &(timeb.hour), 1);
+    memcpy(entry+25, &(timeb.min), 1);
+    memcpy(entry+26, &(timeb.sec), 1);
+}
+
+//resolves the chain of a file entry's current data. exits if it is corrupt
+uint32_t fileExtents(char *fp, char *entry, struct extent_t **extents){
+    uint32_t size = fourbfield(entry, 9);
+    uint32_t needed = size/SB.block_size + (size%SB.block_size == 0 ? 0 : 1);
+    *extents = NULL;
+    if(needed == 0) return 0;
+    uint32_t n = resolveExtents(fp, fourbfield(entry, 1), needed, extents);
+    if(n == 0){
+        fprintf(stderr, "Corrupt file.\n");
+        exit(1);
+    }
+    return n;
+}
+
+//adds the input to the end of an existing file. only the old tail block is written again, to fill it up,
+//and the rest goes into new blocks linked behind it, taken right after it when they are free
+void appendFile(char *fp, char *entry, int ifp, int64_t known, char *buf, long chunk, char *path, FILE *out){
+    struct extent_t *extents;
+    uint32_t n = fileExtents(fp, entry, &extents);
+    uint32_t size = fourbfield(entry, 9);
+    uint32_t start = n > 0 ? fourbfield(entry, 1) : 0xFFFFFFFF;
+    uint32_t tail = n > 0 ? extents[n-1].start+extents[n-1].count-1 : 0xFFFFFFFF;
+    free(extents);
+    if(known >= 0 && size+known > 0xFFFFFFFFLL){
+        fprintf(stderr, "File too large.\n");
+        exit(1);
+    }
+    int64_t added = 0;
+    long used = size%SB.block_size;
+    if(used > 0){//fill up the tail block
+        long got = readFull(ifp, buf, SB.block_size-used);
+        struct ioreq_t r = {buf, (int64_t)tail*SB.block_size+used, got};
+        if(got < 0){
+            fprintf(stderr, "Can't read file.\n");
+            exit(1);
+        }
+        if(got > 0 && IO->write(&r, 1) < 0){
+            perror("Error writing image");
+            exit(1);
+        }
+        STAT(bytes, got);
+        added = got;
+    }
+    int64_t more;
+    uint32_t blocks, runs;
+    uint32_t first = writeChain(fp, ifp, known >= 0 ? known-added : -1, buf, chunk, &more, &blocks, &runs, tail);
+    if(size+added+more > 0xFFFFFFFFLL){
+        freeChain(fp, first);
+        fprintf(stderr, "File too large.\n");
+        exit(1);
+    }
+    if(first != 0xFFFFFFFF){
+        if(tail == 0xFFFFFFFF) start = first;
+        else fatSet(fp, tail, first);
+    }
+    updateEntry(entry, start, size+added+more);
+    fprintf(out, "%s: %lld bytes appended, %u new blocks in %u extents\n", path, (long long)(added+more), blocks, runs);
+}
+
+//makes an existing file hold the input. the old blocks are compared with the input block by block and
+//only those that differ are written; the chain is then cut where the input ends or extended past its end
+void updateFile(char *fp, char *entry, int ifp, int64_t known, char *buf, long chunk, char *path, FILE *out){
+    struct extent_t *extents;
+    uint32_t n = fileExtents(fp, entry, &extents);
+    uint32_t start = n > 0 ? fourbfield(entry, 1) : 0xFFFFFFFF;
+    struct ioreq_t *reqs = try_malloc((chunk/SB.block_size+1)*sizeof(struct ioreq_t));
+    uint32_t oldblocks = 0, i, k = 0;
+    for(i=0; i<n; i++){
+        oldblocks += extents[i].count;
+    }
+    uint32_t done = 0, rewritten = 0, last = 0xFFFFFFFF;
+    int64_t size = 0;
+    long got = 0;
+    i = 0;
+    while(done < oldblocks){
+        long want = (int64_t)(oldblocks-done)*SB.block_size < chunk ? (int64_t)(oldblocks-done)*SB.block_size : chunk;
+        if((got = readFull(ifp, buf, want)) <= 0) break;
+        long off;
+        int nreqs = 0;
+        for(off=0; off<got; off+=SB.block_size){
+            uint32_t block = extents[i].start+k;
+            long len = got-off < SB.block_size ? got-off : SB.block_size;
+            if(memcmp(fp+(int64_t)block*SB.block_size, buf+off, len)){
+                if(nreqs > 0 && reqs[nreqs-1].off+reqs[nreqs-1].len == (int64_t)block*SB.block_size){
+                    reqs[nreqs-1].len += len;
+                }else{
+                    reqs[nreqs].buf = buf+off;
+                    reqs[nreqs].off = (int64_t)block*SB.block_size;
+                    reqs[nreqs++].len = len;
+                }
+                rewritten++;
+                STAT(bytes, len);
+            }
+            last = block;
+            done++;
+            if(++k == extents[i].count){
+                i++;
+                k = 0;
+            }
+        }
+        if(nreqs > 0 && IO->write(reqs, nreqs) < 0){
+            perror("Error writing image");
+            exit(1);
+        }
+        size += got;
+        if(got < want) break;
+    }
+    free(reqs);
+    if(got < 0){
+        fprintf(stderr, "Can't read file.\n");
+        exit(1);
+    }
+    uint32_t freed = 0, blocks = 0, runs = 0;
+    int64_t more = 0;
+    if(done < oldblocks){//the input ended inside the old chain
+        if(FM.bits == NULL) buildFreeMap(fp);
+        uint32_t rest = last == 0xFFFFFFFF ? start : fatGet(fp, last);
+        if(last == 0xFFFFFFFF) start = 0xFFFFFFFF;
+        else fatSet(fp, last, 0xFFFFFFFF);
+        freed = oldblocks-done;
+        freeChain(fp, rest);
+    }else{
+        uint32_t first = writeChain(fp, ifp, known >= 0 ? known-size : -1, buf, chunk, &more, &blocks, &runs, last);
+        if(size+more > 0xFFFFFFFFLL){
+            freeChain(fp, first);
+            fprintf(stderr, "File too large.\n");
+            exit(1);
+        }
+        if(first != 0xFFFFFFFF){
+            if(last == 0xFFFFFFFF) start = first;
+            else fatSet(fp, last, first);
+        }
+    }
+    free(extents);
+    updateEntry(entry, start, size+more);
+    fprintf(out, "%s: %u of %u blocks rewritten, %u added, %u freed\n", path, rewritten, done, blocks, freed);
+}
+
+//writes a local file, or stdin for "-", onto the disk and reports it to out. the directory entry is created last,
+//once the final size is known
+void putFile(char *ifile, char *olocation, char *fp, FILE *out){
+    int ifp;
+    struct stat sf;
+    char *existing = findEntry(fp, olocation);
+    if(existing != NULL && (putmode == PUTNEW || !fileNameMatch(existing, existing+27, 0))){
+        fprintf(stderr, "file already exists.");
+        exit(1);
+    }
+    if(!strcmp(ifile, "-")){
+        ifp = STDIN_FILENO;
+    }else if((ifp = open(ifile, O_RDONLY)) < 0){
+        fprintf(stderr, "Can't open file.\n");
+        exit(1);
+    }
+    fstat(ifp, &sf);
+    int64_t known = S_ISREG(sf.st_mode) ? sf.st_size : -1;
+    if(known > 0xFFFFFFFFLL){
+        fprintf(stderr, "File too large.\n");
+        exit(1);
+    }
+    long chunk = putChunk();
+    char *buf = try_malloc(chunk);
+    if(existing != NULL){
+        if(putmode == PUTAPPEND) appendFile(fp, existing, ifp, known, buf, chunk, olocation, out);
+        else updateFile(fp, existing, ifp, known, buf, chunk, olocation, out);
+        free(buf);
+        if(ifp != STDIN_FILENO) close(ifp);
+        return;
+    }
+    int64_t filesize;
+    uint32_t fileblocks, extents;
+    uint32_t first = writeChain(fp, ifp, known, buf, chunk, &filesize, &fileblocks, &extents, 0xFFFFFFFF);
+    free(buf);
+    if(ifp != STDIN_FILENO) close(ifp);
+    writeDirInfo(fp, olocation, 26, SB.rootstart, SB.root_block_count, first, filesize);
+    fprintf(out, "%s: %d blocks in %d extents, average run %.1f blocks\n", olocation, fileblocks, extents, extents ? (double)fileblocks/extents : 0.0);
+    SB.root_block_count = fourbfield(fp, 26);//the root directory may have been extended
+}
+
+int putrecursive = 0;
+
+//a file or directory of the host tree being imported by diskput -r
+struct hostnode_t{
+    char name[FILENAMELIM];
+    char *path;
+    int isdir;
+    int64_t size;
+    struct hostnode_t *children;
+    uint32_t nchildren;
+};
+
+//totals for a recursive import
+struct putstats_t{
+    uint32_t files;
+    uint32_t dirs;
+    uint32_t blocks;
+    uint32_t extents;
+};
+
+//number of blocks a new directory needs to hold count entries
+uint32_t dirBlocksFor(uint32_t count){
+    uint32_t perblock = SB.block_size/64;
+    return count == 0 ? 1 : (count+perblock-1)/perblock;
+}
+
+int compareHostNodes(const void *a, const void *b){
+    return strcmp(((struct hostnode_t *)a)->name, ((struct hostnode_t *)b)->name);
+}
+
+//reads a host directory tree into memory and adds up the blocks its files and directories will take
+void scanHostTree(struct hostnode_t *node, uint64_t *needed){
+    DIR *d = opendir(node->path);
+    struct dirent *de;
+    struct stat sf;
+    uint32_t cap = 16;
+    if(d == NULL){
+        fprintf(stderr, "Can't open directory %s.\n", node->path);
+        exit(1);
+    }
+    node->children = try_malloc(cap*sizeof(struct hostnode_t));
+    node->nchildren = 0;
+    while((de = readdir(d)) != NULL){
+        if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+        if(strlen(de->d_name) >= FILENAMELIM){
+            fprintf(stderr, "Name too long: %s/%s\n", node->path, de->d_name);
+            exit(1);
+        }
+        char *path = try_malloc(strlen(node->path)+strlen(de->d_name)+2);
+        sprintf(path, "%s/%s", node->path, de->d_name);
+        if(lstat(path, &sf) < 0 || (!S_ISREG(sf.st_mode) && !S_ISDIR(sf.st_mode))){
+            fprintf(stderr, "Skipping %s: not a regular file or directory.\n", path);
+            free(path);
+            continue;
+        }
+        if(S_ISREG(sf.st_mode) && sf.st_size > 0xFFFFFFFFLL){
+            fprintf(stderr, "File too large: %s\n", path);
+            exit(1);
+        }
+        if(node->nchildren == cap){
+            cap *= 2;
+            struct hostnode_t *grown = try_malloc(cap*sizeof(struct hostnode_t));
+            memcpy(grown, node->children, node->nchildren*sizeof(struct hostnode_t));
+            free(node->children);
+            node->children = grown;
+        }
+        struct hostnode_t *child = &node->children[node->nchildren++];
+        strcpy(child->name, de->d_name);
+        child->path = path;
+        child->isdir = S_ISDIR(sf.st_mode);
+        child->size = child->isdir ? 0 : sf.st_size;
+        child->children = NULL;
+        child->nchildren = 0;
+    }
+    closedir(d);
+    qsort(node->children, node->nchildren, sizeof(struct hostnode_t), compareHostNodes);
+    uint32_t i;
+    for(i=0; i<node->nchildren; i++){
+        struct hostnode_t *child = &node->children[i];
+        if(child->isdir){
+            scanHostTree(child, needed);
+            *needed += dirBlocksFor(child->nchildren);
+        }else{
+            *needed += child->size/SB.block_size + (child->size%SB.block_size == 0 ? 0 : 1);
+        }
+    }
+}
+
+//finds a directory on the disk, creating it and any missing parents. returns 1 if it already existed
+int ensureDir(char *fp, char *path, long *sizeloc, uint32_t *start, uint32_t *numblocks){
+    char name[FILENAMELIM];
+    int existed = 1;
+    *sizeloc = 26;
+    *start = SB.rootstart;
+    *numblocks = fourbfield(fp, 26);
+    while(*path != '\0'){
+        while(*path == '/') path++;
+        size_t len = strcspn(path, "/");
+        if(len == 0) break;
+        if(len >= FILENAMELIM){
+            fprintf(stderr, "Name too long.\n");
+            exit(1);
+        }
+        memcpy(name, path, len);
+        name[len] = '\0';
+        path += len;
+        char *entry = dirIndexFind(fp, *start, *numblocks, name);
+        if(entry != NULL && !dirNameMatch(entry, name, 0)){
+            fprintf(stderr, "Not a directory: %s\n", name);
+            exit(1);
+        }
+        if(entry == NULL){
+            uint32_t startblk = claimBlock();
+            initDirBlock(fp, startblk);
+            fatSet(fp, startblk, 0xFFFFFFFF);
+            entry = freeDirSlot(fp, *sizeloc, *start, *numblocks);
+            writeEntry(entry, 5, startblk, 1, SB.block_size, name);
+            dirIndexAdd(*start, entry);
+            existed = 0;
+        }
+        *sizeloc = entry-fp+5;
+        *start = fourbfield(entry, 1);
+        *numblocks = fourbfield(entry, 5);
+    }
+    return existed;
+}
+
+//copies an absolute image path with repeated and trailing slashes removed
+void cleanPath(char *to, char *from){
+    char *start = to;
+    for(; *from; from++){
+        if(*from != '/' || to == start || to[-1] != '/') *to++ = *from;
+    }
+    if(to-start > 1 && to[-1] == '/') to--;
+    *to = '\0';
+}
+
+//moves or renames a file or directory by rewriting directory entries only, so no data block is touched.
+//a destination that is an existing directory receives the entry under its old name, and missing parent
+//directories of the destination are created. a rename within a directory rewrites the entry in place
+void moveEntry(char *src, char *dst, char *fp){
+    char from[4096], to[4096+FILENAMELIM];
+    if(src[0] != '/' || dst[0] != '/' || strlen(src) >= sizeof(from) || strlen(dst) >= sizeof(from)){
+        fprintf(stderr, "Input format: /subdir/subdir/filename\n");
+        exit(1);
+    }
+    cleanPath(from, src);
+    cleanPath(to, dst);
+    char *entry = strcmp(from, "/") ? findEntry(fp, from) : NULL;
+    if(entry == NULL){
+        fprintf(stderr, "File not found.\n");
+        exit(1);
+    }
+    char *target = strcmp(to, "/") ? findEntry(fp, to) : NULL;
+    if(!strcmp(to, "/") || (target != NULL && dirNameMatch(target, target+27, 0))){//into a directory
+        if(strcmp(to, "/")) strcat(to, "/");
+        strcat(to, strrchr(from, '/')+1);
+        target = findEntry(fp, to);
+    }
+    if(target != NULL){
+        fprintf(stderr, "file already exists.");
+        exit(1);
+    }
+    size_t len = strlen(from);
+    if((entry[0] & 7) == 5 && !strncmp(to, from, len) && to[len] == '/'){
+        fprintf(stderr, "Can't move a directory into itself.\n");
+        exit(1);
+    }
+    char *name = strrchr(to, '/')+1;
+    if(strlen(name) >= FILENAMELIM){
+        fprintf(stderr, "Name too long.\n");
+        exit(1);
+    }
+    uint32_t srcstart = SB.rootstart;
+    char *slash = strrchr(from, '/');
+    if(slash != from){
+        *slash = '\0';
+        srcstart = fourbfield(findEntry(fp, from), 1);
+    }
+    long sizeloc;
+    uint32_t start, numblocks;
+    name[-1] = '\0';
+    ensureDir(fp, to, &sizeloc, &start, &numblocks);
+    char *slot = start == srcstart ? entry : freeDirSlot(fp, sizeloc, start, numblocks);
+    dirIndexRemove(srcstart, entry, slot == entry);
+    journalTouch(entry, 64);
+    journalTouch(slot, 64);
+    if(slot != entry){
+        memcpy(slot, entry, 64);
+        entry[0] = 0;
+    }
+    memset(slot+27, 0, FILENAMELIM);
+    memcpy(slot+27, name, strlen(name));
+    dirIndexAdd(start, slot);
+    SB.root_block_count = fourbfield(fp, 26);//the root directory may have been extended
+}
+
+//what diskrm removed
+struct rmstats_t{
+    uint32_t files;
+    uint32_t dirs;
+    uint32_t blocks;
+};
+
+//frees the chain of a file or directory entry after checking it is intact, so a corrupt chain can't
+//free blocks that belong to something else. the contents of a directory are freed first
+void removeTree(char *fp, char *entry, char *path, int depth, struct rmstats_t *st){
+    struct extent_t *extents;
+    uint32_t start = fourbfield(entry, 1), blocks = entryBlocks(entry);
+    if(blocks > 0 && resolveExtents(fp, start, blocks, &extents) == 0){
+        fprintf(stderr, "%s: corrupt chain, run diskcheck --repair first.\n", path);
+        exit(1);
+    }
+    if(blocks > 0) free(extents);
+    if((entry[0] & 7) == 5){
+        struct diriter_t it;
+        char *child;
+        if(depth > 4096){
+            fprintf(stderr, "%s: directories nested too deep.\n", path);
+            exit(1);
+        }
+        dirIterInit(&it, start, blocks);
+        while((child = dirIterNext(fp, &it)) != NULL){
+            if((child[0] & 3) == 3 || (child[0] & 7) == 5) removeTree(fp, child, path, depth+1, st);
+        }
+        st->dirs++;
+    }else{
+        st->files++;
+    }
+    if(blocks > 0) freeChain(fp, start);
+    st->blocks += blocks;
+}
+
+//deletes a file, or a directory with everything below it when recursive is set. the FAT chains are
+//zeroed and their blocks returned to the free space index, and the entry is cleared in its directory.
+//entries inside a removed directory go away with its blocks and aren't cleared one by one
+void removeEntry(char *path, char *fp, int recursive){
+    char clean[4096];
+    if(path[0] != '/' || strlen(path) >= sizeof(clean)){
+        fprintf(stderr, "Input format: /subdir/subdir/filename\n");
+        exit(1);
+    }
+    cleanPath(clean, path);
+    if(!strcmp(clean, "/")){
+        fprintf(stderr, "Can't remove the root directory.\n");
+        exit(1);
+    }
+    char *entry = findEntry(fp, clean);
+    if(entry == NULL){
+        fprintf(stderr, "File not found.\n");
+        exit(1);
+    }
+    int isdir = (entry[0] & 7) == 5;
+    if(isdir && !recursive){
+        struct diriter_t it;
+        char *child;
+        dirIterInit(&it, fourbfield(entry, 1), fourbfield(entry, 5));
+        while((child = dirIterNext(fp, &it)) != NULL){
+            if(child[0] & 1){
+                fprintf(stderr, "Directory not empty.\n");
+                exit(1);
+            }
+        }
+    }
+    uint32_t parent = SB.rootstart;
+    char *slash = strrchr(clean, '/');
+    if(slash != clean){
+        *slash = '\0';
+        parent = fourbfield(findEntry(fp, clean), 1);
+        *slash = '/';
+    }
+    if(FM.bits == NULL) buildFreeMap(fp);
+    struct rmstats_t st = {0, 0, 0};
+    removeTree(fp, entry, clean, 0, &st);
+    dirIndexRemove(parent, entry, 0);
+    journalTouch(entry, 64);
+    memset(entry, 0, 58);
+    memset(entry+58, 0xFF, 6);
+    if(isdir) DIRgen++;//indexes of the removed directories must not be found again if their blocks are reused
+    printf("%s: %u files, %u directories, %u blocks freed\n", clean, st.files, st.dirs, st.blocks);
+}
+
+//imports the children of a host directory into a disk directory. the blocks for all new subdirectories
+//are claimed together, every file is streamed in, and then all the entries are written in one pass
+//over the directory before descending into the subdirectories
+void fillDir(char *fp, struct hostnode_t *node, long sizeloc, uint32_t start, uint32_t numblocks, char *buf, long chunk, struct putstats_t *st){
+    uint32_t i, want = 0, have = 0;
+    uint32_t *firsts = try_malloc((node->nchildren+1)*sizeof(uint32_t));
+    uint32_t *sizes = try_malloc((node->nchildren+1)*sizeof(uint32_t));
+    uint32_t *counts = try_malloc((node->nchildren+1)*sizeof(uint32_t));
+    for(i=0; i<node->nchildren; i++){
+        if(node->children[i].isdir) want += dirBlocksFor(node->children[i].nchildren);
+    }
+    uint32_t *dirblocks = try_malloc((want+1)*sizeof(uint32_t));
+    while(have < want){
+        uint32_t got;
+        uint32_t run = claimRun(want-have, &got);
+        while(got-- > 0){
+            initDirBlock(fp, run);
+            dirblocks[have++] = run++;
+        }
+    }
+    have = 0;
+    for(i=0; i<node->nchildren; i++){
+        struct hostnode_t *child = &node->children[i];
+        if(child->isdir){
+            uint32_t j, n = dirBlocksFor(child->nchildren);
+            for(j=0; j<n; j++){
+                fatSet(fp, dirblocks[have+j], j+1 < n ? dirblocks[have+j+1] : 0xFFFFFFFF);
+            }
+            firsts[i] = dirblocks[have];
+            counts[i] = n;
+            sizes[i] = n*SB.block_size;
+            have += n;
+            st->dirs++;
+        }else{
+            int ifp = open(child->path, O_RDONLY);
+            if(ifp < 0){
+                fprintf(stderr, "Can't open file %s.\n", child->path);
+                exit(1);
+            }
+            int64_t filesize;
+            uint32_t extents;
+            firsts[i] = writeChain(fp, ifp, child->size, buf, chunk, &filesize, &counts[i], &extents, 0xFFFFFFFF);
+            sizes[i] = filesize;
+            close(ifp);
+            st->files++;
+            st->blocks += counts[i];
+            st->extents += extents;
+        }
+    }
+    free(dirblocks);
+    char **slots = try_malloc((node->nchildren+1)*sizeof(char *));
+    dirSlots(fp, sizeloc, start, numblocks, node->nchildren, slots);
+    for(i=0; i<node->nchildren; i++){
+        writeEntry(slots[i], node->children[i].isdir ? 5 : 3, firsts[i], counts[i], sizes[i], node->children[i].name);
+        dirIndexAdd(start, slots[i]);
+    }
+    for(i=0; i<node->nchildren; i++){
+        struct hostnode_t *child = &node->children[i];
+        if(child->isdir) fillDir(fp, child, slots[i]-fp+5, firsts[i], counts[i], buf, chunk, st);
+        free(child->path);
+    }
+    free(slots);
+    free(firsts);
+    free(sizes);
+    free(counts);
+    free(node->children);
+}
+
+//copies a host directory tree into a disk directory, which is created if it doesn't exist. the whole tree
+//is read first so a shortage of space or a name clash is caught before anything is written
+void putTree(char *hostdir, char *olocation, char *fp){
+    struct hostnode_t root;
+    struct putstats_t st;
+    struct stat sf;
+    uint64_t needed = 0;
+    if(olocation[0] != '/'){
+        fprintf(stderr, "Input format: /subdir/subdir\n");
+        exit(1);
+    }
+    if(stat(hostdir, &sf) < 0 || !S_ISDIR(sf.st_mode)){
+        fprintf(stderr, "Can't open directory %s.\n", hostdir);
+        exit(1);
+    }
+    root.path = strdup(hostdir);
+    if(strlen(root.path) > 1 && root.path[strlen(root.path)-1] == '/') root.path[strlen(root.path)-1] = '\0';
+    scanHostTree(&root, &needed);
+    if(needed > FB.available){
+        fprintf(stderr, "Not enough free space on disk.\n");
+        exit(1);
+    }
+    char *entry = findEntry(fp, olocation);
+    if(entry != NULL && (entry[0] & 7) != 5 && strspn(olocation, "/") != strlen(olocation)){
+        fprintf(stderr, "Not a directory: %s\n", olocation);
+        exit(1);
+    }
+    if(entry != NULL || strspn(olocation, "/") == strlen(olocation)){//an existing directory can't already hold the names
+        uint32_t i;
+        for(i=0; i<root.nchildren; i++){
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%s", olocation, root.children[i].name);
+            if(findEntry(fp, path) != NULL){
+                fprintf(stderr, "file already exists: %s\n", path);
+                exit(1);
+            }
+        }
+    }
+    long sizeloc;
+    uint32_t start, numblocks;
+    ensureDir(fp, olocation, &sizeloc, &start, &numblocks);
+    long chunk = putChunk();
+    char *buf = try_malloc(chunk);
+    memset(&st, 0, sizeof(st));
+    fillDir(fp, &root, sizeloc, start, numblocks, buf, chunk, &st);
+    free(buf);
+    free(root.path);
+    SB.root_block_count = fourbfield(fp, 26);//the root directory may have been extended
+    printf("%s: %d files, %d directories, %d blocks in %d extents\n", olocation, st.files, st.dirs, st.blocks, st.extents);
+}
+#endif
+
+#if defined(PART3)
+//ways of moving image bytes into the local file, from fastest to the plain fallback
+#define COPYRANGE 0
+#define SPLICE 1
+#define SENDFILE 2
+#define WRITE 3
+
+//copies len bytes at offset off of the image into out through the selected backend. each buffer
+//full is read as several requests at once so io_uring can keep them in flight together
+void copyBuffered(int out, int64_t off, int64_t len){
+    static __thread char *buf = NULL;
+    struct ioreq_t reqs[IOBUFSIZE/IOCHUNK];
+    if(buf == NULL) buf = try_malloc(IOBUFSIZE);
+    while(len > 0){
+        int64_t total = len < IOBUFSIZE ? len : IOBUFSIZE;
+        int n = 0;
+        int64_t done;
+        for(done=0; done<total; done+=IOCHUNK){
+            reqs[n].buf = buf+done;
+            reqs[n].off = off+done;
+            reqs[n++].len = total-done < IOCHUNK ? total-done : IOCHUNK;
+        }
+        if(IO->read(reqs, n) < 0){
+            fprintf(stderr, "Can't read disk image.\n");
+            exit(1);
+        }
+        writeAll(out, buf, total);
+        off += total;
+        len -= total;
+    }
+}
+
+//copies len bytes at offset off of the image into out. with the default mmap backend the kernel copies
+//it directly, falling back to the next method whenever one isn't supported for this pair of files
+//and remembering it in mode. the other backends, and ranges the journal has made private since the
+//file doesn't hold them yet, are read through a buffer
+void copyOut(char *fp, int out, int64_t off, int64_t len, int *mode){
+    int phase = statsPhase(PHASETRANSFER);
+    struct ioreq_t r = {NULL, off, len};
+    STAT(blocks, (len+SB.block_size-1)/SB.block_size);
+    STAT(bytes, len);
+    if(IO != &BACKENDS[MMAPIO] || ioMapped(&r)){
+        copyBuffered(out, off, len);
+        statsPhase(phase);
+        return;
+    }
+    ssize_t n;
+    while(len > 0){
+        if(*mode == COPYRANGE){
+            loff_t in = off;
+            n = copy_file_range(IM.fd, &in, out, NULL, len, 0);
+        }else if(*mode == SPLICE){
+            loff_t in = off;
+            n = splice(IM.fd, &in, out, NULL, len, SPLICE_F_MORE);
+        }else if(*mode == SENDFILE){
+            off_t in = off;
+            n = sendfile(out, IM.fd, &in, len);
+        }else if(WM.enabled){//write() can't fault windows in
+            copyBuffered(out, off, len);
+            break;
+        }else{
+            n = write(out, fp+off, len);
+        }
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0){
+            if(*mode == WRITE){
+                fprintf(stderr, "Can't write local file.\n");
+                exit(1);
+            }
+            *mode = *mode == SENDFILE ? WRITE : SENDFILE;
+            continue;
+        }
+        off += n;
+        len -= n;
+    }
+    statsPhase(phase);
+}
+
+//transfers file from disk to specified file/location on current linux machine ("-" is stdout).
+//the chain is resolved into extents first and each extent is copied in one go
+void transferFile(char *fp, char *filename, uint32_t filesizeblk, uint32_t filesize, uint32_t startblk){
+    int new;
+    struct stat sf;
+    if(!strcmp(filename, "-")){
+        new = STDOUT_FILENO;
+    }else if((new = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0){
+        fprintf(stderr, "Can't open disk file.\n");
+        exit(1);
+    }
+    struct extent_t *extents;
+    uint32_t needed = filesize/SB.block_size + (filesize%SB.block_size == 0 ? 0 : 1);
+    uint32_t n = resolveExtents(fp, startblk, needed, &extents);
+    if(n == 0 && needed > 0){
+        fprintf(stderr, "Corrupt file.\n");
+        exit(1);
+    }
+    fstat(new, &sf);
+    int mode = S_ISFIFO(sf.st_mode) ? SPLICE : COPYRANGE;
+    int64_t left = filesize;
+    uint32_t i;
+    struct readahead_t ra;
+    readaheadInit(&ra, extents, n, 0, 0, 0);
+    for(i=0; i<n; i++){
+        int64_t len = (int64_t)extents[i].count*SB.block_size;
+        if(len > left) len = left;
+        readaheadAdvance(&ra, filesize-left);
+        copyOut(fp, new, (int64_t)extents[i].start*SB.block_size, len, &mode);
+        left -= len;
+    }
+    free(extents);
+    if(new != STDOUT_FILENO) close(new);
+}
+
+//byte range of the file diskget copies out. a negative length means up to the end of the file
+int64_t getoffset = 0;
+int64_t getlength = -1;
+
+//copies only the requested range of a file out of the disk. the extent holding the start of the
+//range is found through the file's index so the blocks before it are never touched
+void getRange(char *path, char *fp, char *filename){
+    struct diskfile_t *f = diskOpen(fp, path);
+    if(f == NULL){
+        fprintf(stderr, "File not found.\n");
+        exit(1);
+    }
+    if(!diskIndex(fp, f)){
+        fprintf(stderr, "Corrupt file.\n");
+        exit(1);
+    }
+    int new;
+    struct stat sf;
+    if(!strcmp(filename, "-")){
+        new = STDOUT_FILENO;
+    }else if((new = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0){
+        fprintf(stderr, "Can't open disk file.\n");
+        exit(1);
+    }
+    fstat(new, &sf);
+    int mode = S_ISFIFO(sf.st_mode) ? SPLICE : COPYRANGE;
+    uint64_t off = getoffset < f->size ? getoffset : f->size;
+    uint64_t left = f->size-off;
+    if(getlength >= 0 && getlength < left) left = getlength;
+    uint32_t i = f->nextents > 0 ? diskSeek(f, off) : 0;
+    uint64_t first = off;
+    struct readahead_t ra;
+    readaheadInit(&ra, f->extents, f->nextents, i, f->nextents > 0 ? off-f->offsets[i] : 0, 0);
+    while(left > 0){
+        uint64_t inext = off-f->offsets[i];
+        uint64_t n = (uint64_t)f->extents[i].count*SB.block_size - inext;
+        if(n > left) n = left;
+        readaheadAdvance(&ra, off-first);
+        copyOut(fp, new, (int64_t)f->extents[i].start*SB.block_size+inext, n, &mode);
+        off += n;
+        left -= n;
+        i++;
+    }
+    diskClose(f);
+    if(new != STDOUT_FILENO) close(new);
+}
+
+//locates where the file to retrieve is in disk
+void getFile(char* dirname, char* fp, int start, int numblocks, char *filename){
+    if(dirname[0] == '/'){
+        dirname++;
+        if(dirname[0] == '\0'){
+            fprintf(stderr, "Input format: /subdir/subdir/filename\n");
+            exit(1);
+        }
+        int i = 0;
+        char tempbuf[FILENAMELIM];
+        while(dirname[0]  != '/' && dirname[0] != '\0'){
+            tempbuf[i++] = dirname[0];
+            dirname++;
+        }
+        tempbuf[i] = '\0';
+        char *entry = dirIndexFind(fp, start, numblocks, tempbuf);
+        if(entry == NULL){
+            fprintf(stderr, "File not found.\n");
+            exit(1);
+        }
+        uint32_t startb = fourbfield(entry, 1);
+        uint32_t dirsizeb = fourbfield(entry, 5);
+        uint32_t filesize = fourbfield(entry, 9);
+        if(dirname[0] == '\0'){//is a file
+            transferFile(fp, filename, dirsizeb, filesize, startb);
+        }else{//is a directory
+            getFile(dirname, fp, startb, dirsizeb, filename);
+        }
+    }else{
+        fprintf(stderr, "Input format: /subdir/subdir/filename\n");
+        exit(1);
+    }
+}
+//creates a local directory and any missing parents, like mkdir -p
+void makeDirs(char *path){
+    char *p = strdup(path);
+    char *slash = p;
+    while((slash = strchr(slash+1, '/')) != NULL){
+        *slash = '\0';
+        mkdir(p, 0755);
+        *slash = '/';
+    }
+    if(mkdir(p, 0755) < 0 && errno != EEXIST){
+        fprintf(stderr, "Can't create local directory %s.\n", p);
+        exit(1);
+    }
+    free(p);
+}
+
+//one file or directory to extract in a bulk get
+struct gettask_t{
+    char *path;
+    char *local;
+    uint32_t start;
+    uint32_t numblocks;
+    uint32_t size;
+    int isdir;
+};
+
+//glob the image paths must match in a bulk get, and how many components it has
+char *getpattern = NULL;
+int getdepth = 0;
+char *manifest = NULL;
+
+//number of components in an image path
+int pathDepth(char *path){
+    int depth = 0;
+    for(; *path; path++){
+        if(*path == '/') depth++;
+    }
+    return depth;
+}
+
+void getTask(void *arg, int worker);
+
+//queues the extraction of a directory entry found at path to the local name
+void queueGet(int worker, char *path, char *local, char *entry){
+    struct gettask_t *t = try_malloc(sizeof(struct gettask_t));
+    t->path = strdup(path);
+    t->local = strdup(local);
+    t->start = fourbfield(entry, 1);
+    t->numblocks = fourbfield(entry, 5);
+    t->size = fourbfield(entry, 9);
+    t->isdir = (entry[0] & 7) == 5;
+    poolSubmit(worker, getTask, t);
+}
+
+//extracts one file, or queues everything in a directory. with a glob only the files matching it
+//are extracted and directories deeper than the glob are never visited
+void getTask(void *arg, int worker){
+    struct gettask_t *t = arg;
+    char *fp = IM.map;
+    if(t->isdir && !visitDir(t->start)){
+        if(manifest == NULL) dirCycle(t->path);
+        //a manifest can name a directory and something inside it, which is only extracted once
+    }else if(t->isdir){
+        if(getpattern == NULL) makeDirs(t->local);
+        struct diriter_t it;
+        char *entry;
+        char path[4096], local[4096];
+        dirIterInit(&it, t->start, t->numblocks);
+        while((entry = dirIterNext(fp, &it)) != NULL){
+            int isdir = (entry[0] & 7) == 5;
+            if((entry[0] & 3) != 3 && !isdir) continue;
+            snprintf(path, sizeof(path), "%s/%.31s", t->path, entry+27);
+            snprintf(local, sizeof(local), "%s/%.31s", t->local, entry+27);
+            if(getpattern != NULL){
+                if(isdir && pathDepth(path) >= getdepth) continue;
+                if(!isdir && fnmatch(getpattern, path, FNM_PATHNAME) != 0) continue;
+            }
+            queueGet(worker, path, local, entry);
+        }
+    }else{
+        char *slash = strrchr(t->local, '/');
+        if(slash != NULL && slash != t->local){
+            *slash = '\0';
+            makeDirs(t->local);
+            *slash = '/';
+        }
+        transferFile(fp, t->local, t->numblocks, t->size, t->start);
+    }
+    free(t->path);
+    free(t->local);
+    free(t);
+}
+
+//whether a diskget path names a directory or a glob rather than a single file
+int isBulkGet(char *fp, char *dirname){
+    if(strpbrk(dirname, "*?[") != NULL) return 1;
+    if(strspn(dirname, "/") == strlen(dirname)) return 1;
+    char *entry = findEntry(fp, dirname);
+    return entry != NULL && (entry[0] & 7) == 5;
+}
+
+//extracts many files at once with the worker pool: a whole directory into the local directory,
+//every file matching a glob, or every path listed in the manifest. files keep their image paths
+//below the local directory, except for a directory whose contents go straight into it
+void getMany(char *dirname, char *fp, char *localdir){
+    char path[4096], local[4096];
+    poolInit();
+    visitInit();
+    if(manifest != NULL){
+        FILE *in = fopen(manifest, "r");
+        if(in == NULL){
+            fprintf(stderr, "Can't open manifest.\n");
+            exit(1);
+        }
+        while(fgets(path, sizeof(path), in) != NULL){
+            path[strcspn(path, "\r\n")] = '\0';
+            if(path[0] == '\0') continue;
+            char *entry = findEntry(fp, path);
+            if(entry == NULL){
+                fprintf(stderr, "File not found: %s\n", path);
+                exit(1);
+            }
+            snprintf(local, sizeof(local), "%s%s", localdir, path);
+            queueGet(0, path, local, entry);
+        }
+        fclose(in);
+    }else{
+        struct gettask_t *t = try_malloc(sizeof(struct gettask_t));
+        t->isdir = 1;
+        t->local = strdup(localdir);
+        if(strpbrk(dirname, "*?[") != NULL){
+            getpattern = dirname;
+            getdepth = pathDepth(dirname);
+            t->path = strdup("");
+            t->start = SB.rootstart;
+            t->numblocks = SB.root_block_count;
+        }else{
+            char *entry = findEntry(fp, dirname);
+            t->path = strdup(dirname);
+            if(entry != NULL){
+                t->start = fourbfield(entry, 1);
+                t->numblocks = fourbfield(entry, 5);
+            }else{
+                t->start = SB.rootstart;
+                t->numblocks = SB.root_block_count;
+            }
+            if(t->path[strlen(t->path)-1] == '/') t->path[strlen(t->path)-1] = '\0';
+        }
+        poolSubmit(0, getTask, t);
+    }
+    poolRun();
+}
+#endif
+
+#if defined(PART2)
+//prints information about every file in a directory
+void printFileInfo(FILE *out, char* fp, uint32_t start, uint32_t numblocks){
+    int i;
+    uint32_t nextblock = start;
+    struct extent_t *extents = NULL;
+    struct readahead_t ra;
+    if(prefetching && numblocks > 1){//the directory's blocks are faulted in ahead of the listing
+        uint32_t n = resolveExtents(fp, start, numblocks, &extents);
+        readaheadInit(&ra, extents, n, 0, 0, 1);
+        readaheadAdvance(&ra, 0);
+    }
+    for(i=0;i<numblocks*SB.block_size;i+=64){
+        if(i%SB.block_size == 0 && i != 0){
+            if(extents != NULL) readaheadAdvance(&ra, i);
+            nextblock = fourbfield(fp, (int64_t)SB.FATstart*SB.block_size + 4*(int64_t)nextblock);
+            if(nextblock == 0xFFFFFFFF)break;
+        }
+        if((fp[i%SB.block_size+(int64_t)nextblock*SB.block_size] & 3) == 3){
+            fprintf(out, "F ");
+        }else if((fp[i%SB.block_size+(int64_t)nextblock*SB.block_size] & 7) == 5){
+            fprintf(out, "D ");
+        }else{
+            continue;
+        }
+        uint32_t filesize = fourbfield(fp, i%SB.block_size+(int64_t)nextblock*SB.block_size+9);
+        char filename[FILENAMELIM];
+        int x = 0;
+        for(x=0; x<FILENAMELIM; x++){
+            filename[x] = fp[i%SB.block_size+27+(int64_t)nextblock*SB.block_size+x];
+        }
+        uint16_t year = twobfield(fp, i%SB.block_size+(int64_t)nextblock*SB.block_size+20);
+        uint8_t month = onebfield(fp, i%SB.block_size+(int64_t)nextblock*SB.block_size+22);
+        uint8_t day = onebfield(fp, i%SB.block_size+(int64_t)nextblock*SB.block_size+23);
+        uint8_t hour = onebfield(fp, i%SB.block_size+(int64_t)nextblock*SB.block_size+24);
+        uint8_t minute = onebfield(fp, i%SB.block_size+(int64_t)nextblock*SB.block_size+25);
+        uint8_t second = onebfield(fp, i%SB.block_size+(int64_t)nextblock*SB.block_size+26);
+        fprintf(out, "%10d %30s ", filesize, filename);
+        fprintf(out, "%4d/%02d/%02d %2d:%02d:%02d\n", year, month, day, (hour+17)%24, minute, second);
+    }
+    free(extents);
+}
+
+//finds the directory to print information about.
+void printDirInfo(char* dirname, char* fp, int start, int numblocks){
+    if(dirname[0] == '/'){
+        dirname++;
+        if(dirname[0] == '\0'){
+            printFileInfo(stdout, fp, start, numblocks);
+            return;
+        }
+        int i = 0;
+        char tempbuf[FILENAMELIM];
+        while(dirname[0]  != '/' && dirname[0] != '\0'){
+            tempbuf[i++] = dirname[0];
+            dirname++;
+        }
+        tempbuf[i] = '\0';
+        char *entry = dirIndexFind(fp, start, numblocks, tempbuf);
+        if(entry == NULL || !dirNameMatch(entry, tempbuf, 0)){
+            fprintf(stderr, "Directory not found.\n");
+            return;
+        }
+        uint32_t startb = fourbfield(entry, 1);
+        uint32_t dirsizeb = fourbfield(entry, 5);
+        if(dirname[0] == '\0'){
+            printFileInfo(stdout, fp, startb, dirsizeb);
+        }else{
+            printDirInfo(dirname, fp, startb, dirsizeb);
+        }
+    }else{
+        fprintf(stderr, "Input format: /subdir/subdir/subdir\n");
+        exit(1);
+    }
+}
+
+int recursive = 0;
+
+//one directory to list in a recursive listing. key orders the listings like a sequential depth first walk:
+//it is the parent's key followed by the entry's index in its parent as eight hex digits
+struct listtask_t{
+    char *path;
+    char *key;
+    uint32_t start;
+    uint32_t numblocks;
+};
+
+//the finished listing of one directory
+struct listing_t{
+    char *key;
+    char *text;
+};
+
+//listings buffered by each worker until the merge
+struct listbuf_t{
+    struct listing_t *items;
+    long count;
+    long cap;
+};
+
+struct listbuf_t *LB;
+
+//lists one directory into the worker's buffer and queues its subdirectories on the worker's deque
+void listTask(void *arg, int worker){
+    struct listtask_t *t = arg;
+    char *fp = IM.map;
+    char *text;
+    size_t len;
+    if(!visitDir(t->start)) dirCycle(t->path);
+    FILE *out = open_memstream(&text, &len);
+    fprintf(out, "%s:\n", t->path);
+    printFileInfo(out, fp, t->start, t->numblocks);
+    fprintf(out, "\n");
+    fclose(out);
+    struct listbuf_t *b = &LB[worker];
+    if(b->count == b->cap){
+        b->cap = b->cap ? 2*b->cap : 64;
+        b->items = realloc(b->items, b->cap*sizeof(struct listing_t));
+        if(b->items == NULL){
+            perror("Error allocating memory");
+            exit(1);
+        }
+    }
+    b->items[b->count].key = t->key;
+    b->items[b->count++].text = text;
+    struct diriter_t it;
+    char *entry;
+    uint32_t ndx = 0;
+    dirIterInit(&it, t->start, t->numblocks);
+    while((entry = dirIterNext(fp, &it)) != NULL){
+        ndx++;
+        if((entry[0] & 7) != 5) continue;
+        struct listtask_t *child = try_malloc(sizeof(struct listtask_t));
+        child->path = try_malloc(strlen(t->path)+FILENAMELIM+2);
+        sprintf(child->path, "%s%s%.31s", t->path, strcmp(t->path, "/") ? "/" : "", entry+27);
+        child->key = try_malloc(strlen(t->key)+9);
+        sprintf(child->key, "%s%08x", t->key, ndx);
+        child->start = fourbfield(entry, 1);
+        child->numblocks = fourbfield(entry, 5);
+        poolSubmit(worker, listTask, child);
+    }
+    free(t->path);
+    free(t);
+}
+
+//orders listings by key
+int compareListings(const void *a, const void *b){
+    return strcmp(((struct listing_t *)a)->key, ((struct listing_t *)b)->key);
+}
+
+//lists a directory and everything below it. directories are listed in parallel by the worker pool,
+//then the per-worker buffers are merged and sorted by key so the output doesn't depend on scheduling
+void listRecursive(char *dirname, char *fp){
+    struct listtask_t *t = try_malloc(sizeof(struct listtask_t));
+    if(dirname[0] != '/'){
+        fprintf(stderr, "Input format: /subdir/subdir/subdir\n");
+        exit(1);
+    }
+    char *entry = findEntry(fp, dirname);
+    if(entry != NULL && (entry[0] & 7) == 5){
+        t->start = fourbfield(entry, 1);
+        t->numblocks = fourbfield(entry, 5);
+    }else if(strspn(dirname, "/") == strlen(dirname)){
+        t->start = SB.rootstart;
+        t->numblocks = SB.root_block_count;
+    }else{
+        fprintf(stderr, "Directory not found.\n");
+        exit(1);
+    }
+    t->path = strdup(dirname);
+    t->key = strdup("");
+    poolInit();
+    visitInit();
+    LB = try_malloc(POOL.nworkers*sizeof(struct listbuf_t));
+    memset(LB, 0, POOL.nworkers*sizeof(struct listbuf_t));
+    poolSubmit(0, listTask, t);
+    poolRun();
+    long total = 0;
+    int w;
+    for(w=0; w<POOL.nworkers; w++){
+        total += LB[w].count;
+    }
+    struct listing_t *all = try_malloc((total+1)*sizeof(struct listing_t));
+    long n = 0, i;
+    for(w=0; w<POOL.nworkers; w++){
+        memcpy(all+n, LB[w].items, LB[w].count*sizeof(struct listing_t));
+        n += LB[w].count;
+    }
+    qsort(all, n, sizeof(struct listing_t), compareListings);
+    for(i=0; i<n; i++){
+        fputs(all[i].text, stdout);
+    }
+}
+#endif
+
+#if defined(PART1)
+//prints information from the super block and FAT
+void printDiskInfo(FILE *out){
+    fprintf(out, "Super block information:\n");
+    fprintf(out, "Block size: %d\n", SB.block_size);
+    fprintf(out, "Block count: %d\n", SB.block_count);
+    fprintf(out, "FAT starts: %d\n", SB.FATstart);
+    fprintf(out, "FAT blocks: %d\n", SB.FATblocks);
+    fprintf(out, "Root directory start: %d\n", SB.rootstart);
+    fprintf(out, "Root directory blocks: %d\n\n", SB.root_block_count);
+    fprintf(out, "FAT information:\n");
+    fprintf(out, "Free Blocks: %d\n", FB.available);
+    fprintf(out, "Reserved Blocks: %d\n", FB.reserved);
+    fprintf(out, "Allocated Blocks: %d\n", FB.allocated);
+}
+#endif
+
+//counts free and reserved FAT entries one at a time. entries are compared against the
+//big-endian encodings of 0 and 1 so nothing has to be byte swapped
+void countFATscalar(char *fat, uint32_t n, uint32_t *freecount, uint32_t *reservedcount){
+    uint32_t one = htonl(1);
+    uint32_t i, v;
+    for(i=0; i<n; i++){
+        memcpy(&v, fat+4*i, 4);
+        *freecount += (v == 0);
+        *reservedcount += (v == one);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//counts four entries per step. each compare gives -1 in matching lanes which is subtracted into the totals
+__attribute__((target("sse2")))
+void countFATsse2(char *fat, uint32_t n, uint32_t *freecount, uint32_t *reservedcount){
+    __m128i zero = _mm_setzero_si128();
+    __m128i one = _mm_set1_epi32(htonl(1));
+    __m128i frees = _mm_setzero_si128();
+    __m128i reserved = _mm_setzero_si128();
+    uint32_t i;
+    for(i=0; i+4<=n; i+=4){
+        __m128i v = _mm_loadu_si128((__m128i *)(fat+4*i));
+        frees = _mm_sub_epi32(frees, _mm_cmpeq_epi32(v, zero));
+        reserved = _mm_sub_epi32(reserved, _mm_cmpeq_epi32(v, one));
+    }
+    uint32_t lanes[4];
+    int k;
+    _mm_storeu_si128((__m128i *)lanes, frees);
+    for(k=0; k<4; k++) *freecount += lanes[k];
+    _mm_storeu_si128((__m128i *)lanes, reserved);
+    for(k=0; k<4; k++) *reservedcount += lanes[k];
+    countFATscalar(fat+4*i, n-i, freecount, reservedcount);
+}
+
+//same as countFATsse2 with eight entries per step
+__attribute__((target("avx2")))
+void countFATavx2(char *fat, uint32_t n, uint32_t *freecount, uint32_t *reservedcount){
+    __m256i zero = _mm256_setzero_si256();
+    __m256i one = _mm256_set1_epi32(htonl(1));
+    __m256i frees = _mm256_setzero_si256();
+    __m256i reserved = _mm256_setzero_si256();
+    uint32_t i;
+    for(i=0; i+8<=n; i+=8){
+        __m256i v = _mm256_loadu_si256((__m256i *)(fat+4*i));
+        frees = _mm256_sub_epi32(frees, _mm256_cmpeq_epi32(v, zero));
+        reserved = _mm256_sub_epi32(reserved, _mm256_cmpeq_epi32(v, one));
+    }
+    uint32_t lanes[8];
+    int k;
+    _mm256_storeu_si256((__m256i *)lanes, frees);
+    for(k=0; k<8; k++) *freecount += lanes[k];
+    _mm256_storeu_si256((__m256i *)lanes, reserved);
+    for(k=0; k<8; k++) *reservedcount += lanes[k];
+    countFATscalar(fat+4*i, n-i, freecount, reservedcount);
+}
+#endif
+
+//picks the widest FAT counting kernel the cpu supports
+void (*pickFATcounter(void))(char *, uint32_t, uint32_t *, uint32_t *){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) return countFATavx2;
+    if(__builtin_cpu_supports("sse2")) return countFATsse2;
+#endif
+    return countFATscalar;
+}
+
+//FNV-1a over a buffer, continuing from hash
+uint32_t journalHash(uint32_t hash, char *buf, long len){
+    long i;
+    for(i=0; i<len; i++){
+        hash = (hash ^ (uint8_t)buf[i]) * 16777619u;
+    }
+    return hash;
+}
+
+//commits the open transaction: flushes the file data written in place, appends the private pages to the
+//journal and syncs it, then copies them into the image and returns them to the shared mapping. the
+//journal is emptied once the image itself is synced. many operations share one commit
+void journalCommit(void){
+    if(!JN.enabled || (JN.npages == 0 && JN.nfreed == 0)) return;
+    int phase = statsPhase(PHASECOMMIT);
+    uint32_t i;
+    if(JN.npages > 0){
+        char path[4096];
+        struct jheader_t head;
+        struct jcommit_t tail;
+        msync(IM.map, IM.size, MS_SYNC);
+        if(WM.enabled) fdatasync(IM.fd);//data in windows unmapped since it was written
+        if(JN.fd < 0){
+            snprintf(path, sizeof(path), "%s.fjnl", IM.name);
+            if((JN.fd = open(path, O_RDWR | O_CREAT, 0644)) < 0){
+                fprintf(stderr, "Can't open journal.\n");
+                exit(1);
+            }
+        }
+        head.magic = JOURNALMAGIC;
+        head.npages = JN.npages;
+        head.seq = ++JN.seq;
+        head.pagesize = JN.pagesize;
+        tail.magic = COMMITMAGIC;
+        tail.checksum = 2166136261u;
+        tail.seq = head.seq;
+        lseek(JN.fd, 0, SEEK_SET);
+        writeAll(JN.fd, (char *)&head, sizeof(head));
+        for(i=0; i<JN.npages; i++){
+            int64_t off = JN.pages[i]*JN.pagesize;
+            tail.checksum = journalHash(tail.checksum, (char *)&off, 8);
+            tail.checksum = journalHash(tail.checksum, IM.map+off, JN.pagesize);
+            writeAll(JN.fd, (char *)&off, 8);
+            writeAll(JN.fd, IM.map+off, JN.pagesize);
+        }
+        writeAll(JN.fd, (char *)&tail, sizeof(tail));
+        fdatasync(JN.fd);
+        if(getenv("FJNL_CRASH") != NULL) _exit(9);//lets the tests stop here, as a crash would
+        for(i=0; i<JN.npages; i++){
+            long off = JN.pages[i]*JN.pagesize;
+            long len = off+JN.pagesize > IM.size ? IM.size-off : JN.pagesize;
+            if(pwrite(IM.fd, IM.map+off, len, off) != len){
+                perror("Error writing image");
+                exit(1);
+            }
+            mmap(IM.map+off, JN.pagesize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, IM.fd, off);
+            JN.private[JN.pages[i]] = 0;
+        }
+        fdatasync(IM.fd);
+        ftruncate(JN.fd, 0);
+        JN.npages = 0;
+        windowUnpinTxn();
+    }
+    for(i=0; i<JN.nfreed; i+=2){
+        uint32_t start = JN.freed[i], count = JN.freed[i+1];
+        while(i+2 < JN.nfreed && JN.freed[i+2] == start+count){//runs freed one after another
+            count += JN.freed[i+3];
+            i += 2;
+        }
+        returnRun(start, count);
+    }
+    JN.nfreed = 0;
+    punchHoles();
+    statsPhase(phase);
+}
+
+//copies every complete transaction left in the journal into the image and empties the journal.
+//a transaction without a valid commit record was never applied and is dropped
+void journalReplay(int fd, char *name){
+    char path[4096];
+    struct jheader_t head;
+    struct jcommit_t tail;
     struct stat sf;
-    char *p;
-    if(argc > 1){
-        disk_name = argv[1];
+    int jfd, replayed = 0;
+    snprintf(path, sizeof(path), "%s.fjnl", name);
+    if((jfd = open(path, O_RDWR)) < 0) return;
+    fstat(fd, &sf);
+    while(read(jfd, &head, sizeof(head)) == sizeof(head) && head.magic == JOURNALMAGIC){
+        long len = (long)head.npages*(8+head.pagesize);
+        char *buf = try_malloc(len+1);
+        uint32_t hash = 2166136261u;
+        uint32_t i;
+        if(readFull(jfd, buf, len) != len || read(jfd, &tail, sizeof(tail)) != sizeof(tail)){
+            free(buf);
+            break;
+        }
+        hash = journalHash(hash, buf, len);
+        if(tail.magic != COMMITMAGIC || tail.seq != head.seq || tail.checksum != hash){
+            free(buf);
+            break;
+        }
+        for(i=0; i<head.npages; i++){
+            char *rec = buf+(long)i*(8+head.pagesize);
+            int64_t off;
+            memcpy(&off, rec, 8);
+            long n = off+(long)head.pagesize > sf.st_size ? sf.st_size-off : (long)head.pagesize;
+            if(n > 0 && pwrite(fd, rec+8, n, off) != n){
+                perror("Error replaying journal");
+                exit(1);
+            }
+        }
+        free(buf);
+        replayed++;
+    }
+    if(replayed > 0){
+        fdatasync(fd);
+        fprintf(stderr, "Replayed %d journal transaction%s.\n", replayed, replayed == 1 ? "" : "s");
+    }
+    ftruncate(jfd, 0);
+    fsync(jfd);
+    close(jfd);
+}
+
+//loads the FAT counters from the summary sidecar. returns 0 if it is missing or stale
+int readSummary(void){
+    char path[4096];
+    struct summary_t sum;
+    struct stat sf;
+    int fd;
+    snprintf(path, sizeof(path), "%s.fsum", IM.name);
+    if((fd = open(path, O_RDONLY)) < 0) return 0;
+    ssize_t n = read(fd, &sum, sizeof(sum));
+    close(fd);
+    if(n != sizeof(sum) || sum.magic != SUMMARYMAGIC || sum.version != SUMMARYVERSION) return 0;
+    fstat(IM.fd, &sf);
+    if(sum.ino != sf.st_ino || sum.size != sf.st_size) return 0;
+    if(sum.mtime_sec != sf.st_mtim.tv_sec || sum.mtime_nsec != sf.st_mtim.tv_nsec) return 0;
+    if(sum.block_count != SB.block_count || sum.FATblocks != SB.FATblocks) return 0;
+    FB.reserved = sum.reserved;
+    FB.available = sum.available;
+    FB.allocated = sum.allocated;
+    FM.cursor = sum.cursor;
+    return 1;
+}
+
+//commits the open journal transaction, flushes the image and records the current FAT counters in the summary sidecar.
+//failures are ignored since the summary is only a cache of the FAT
+void writeSummary(void){
+    char path[4096], temp[4096];
+    struct summary_t sum;
+    struct stat sf;
+    int fd;
+    int phase = statsPhase(PHASECOMMIT);
+    journalCommit();
+    punchHoles();
+    msync(IM.map, IM.size, MS_SYNC);
+    fstat(IM.fd, &sf);
+    memset(&sum, 0, sizeof(sum));
+    sum.magic = SUMMARYMAGIC;
+    sum.version = SUMMARYVERSION;
+    sum.ino = sf.st_ino;
+    sum.size = sf.st_size;
+    sum.mtime_sec = sf.st_mtim.tv_sec;
+    sum.mtime_nsec = sf.st_mtim.tv_nsec;
+    sum.block_count = SB.block_count;
+    sum.FATblocks = SB.FATblocks;
+    sum.reserved = FB.reserved;
+    sum.available = FB.available;
+    sum.allocated = FB.allocated;
+    sum.cursor = FM.cursor;
+    snprintf(path, sizeof(path), "%s.fsum", IM.name);
+    snprintf(temp, sizeof(temp), "%s.fsum.tmp", IM.name);
+    if((fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0){
+        if(write(fd, &sum, sizeof(sum)) == sizeof(sum)){
+            close(fd);
+            rename(temp, path);
+        }else{
+            close(fd);
+            unlink(temp);
+        }
+    }
+    statsPhase(phase);
+}
+
+//counts the allocated/reserved/free blocks, from the summary when it is still valid or else by scanning the FAT
+void readFATinfo(char* fp){
+    int phase = statsPhase(PHASESUMMARY);
+    if(IM.rescan || !readSummary()){
+        FB.reserved = 0;
+        FB.available = 0;
+        long FS = (long)SB.block_size*SB.FATstart;
+        pickFATcounter()(fp+FS, (int64_t)SB.FATblocks*SB.block_size/4, &FB.available, &FB.reserved);
+        STAT(fatreads, (int64_t)SB.FATblocks*SB.block_size/4);
+        FB.allocated = SB.block_count - FB.reserved - FB.available;
+        writeSummary();
+    }
+    statsPhase(phase);
+}
+
+//reads the superblock to get information about the filesystem
+void readSuperBlock(char *fp){    
+    SB.block_size = twobfield(fp, 8);
+    SB.block_count = fourbfield(fp, 10);
+    SB.FATstart = fourbfield(fp, 14);
+    SB.FATblocks = fourbfield(fp, 18);
+    SB.rootstart = fourbfield(fp, 22);
+    SB.root_block_count = fourbfield(fp, 26);
+    windowPin(0, ((int64_t)SB.FATstart+SB.FATblocks)*SB.block_size, PINNEDFAT);
+    if(prefetching) hintRange((int64_t)SB.FATstart*SB.block_size, (int64_t)SB.FATblocks*SB.block_size, 1);
+    readFATinfo(fp);
+}
+
+#if defined(BENCH)
+//the original FAT loop, kept as the baseline the kernels are measured against
+void countFATbytes(char *fat, uint32_t n, uint32_t *freecount, uint32_t *reservedcount){
+    uint32_t i, temp;
+    for(i=0; i<n; i++){
+        temp = fourbfield(fat, 4*i);
+        if(temp == 0){
+            (*freecount)++;
+        }else if(temp == 1){
+            (*reservedcount)++;
+        }
+    }
+}
+
+//runs a FAT counting kernel for at least half a second and prints entries per second
+void benchFATcounter(char *name, void (*counter)(char *, uint32_t, uint32_t *, uint32_t *), char *fat, uint32_t n){
+    uint32_t frees, reserved;
+    long rounds = 0;
+    double start = nowSeconds();
+    double elapsed;
+    do{
+        frees = 0;
+        reserved = 0;
+        counter(fat, n, &frees, &reserved);
+        rounds++;
+        elapsed = nowSeconds() - start;
+    }while(elapsed < 0.5);
+    printf("%-8s %12.0f entries/s (free %d, reserved %d)\n", name, (double)n*rounds/elapsed, frees, reserved);
+}
+
+//the original diskget copy loop: one FAT lookup and one fwrite per block
+void transferBlocks(char *fp, char *filename, uint32_t filesizeblk, uint32_t filesize, uint32_t startblk){
+    FILE *new = fopen(filename, "wb");
+    int i;
+    uint32_t nextblock = startblk;
+    for(i=0; i<filesizeblk-1; i++){
+        fwrite(fp+(long)nextblock*SB.block_size, SB.block_size, 1, new);
+        nextblock = fourbfield(fp, (int64_t)SB.FATstart*SB.block_size + 4*(int64_t)nextblock);
+    }
+    uint32_t remainingbytes = filesize%SB.block_size==0 ? SB.block_size : filesize%SB.block_size;
+    fwrite(fp+(long)nextblock*SB.block_size, remainingbytes, 1, new);
+    fclose(new);
+}
+
+//copies a file out of the image for at least half a second and prints the throughput
+void benchCopy(char *name, void (*copy)(char *, char *, uint32_t, uint32_t, uint32_t), char *fp, char *entry){
+    long rounds = 0;
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    double start = nowSeconds();
+    double elapsed;
+    do{
+        copy(fp, "diskbench.out", fourbfield(entry, 5), fourbfield(entry, 9), fourbfield(entry, 1));
+        rounds++;
+        elapsed = nowSeconds() - start;
+    }while(elapsed < 0.5);
+    getrusage(RUSAGE_SELF, &after);
+    unlink("diskbench.out");
+    double cpu = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) + (after.ru_utime.tv_usec - before.ru_utime.tv_usec)/1e6
+        + (after.ru_stime.tv_sec - before.ru_stime.tv_sec) + (after.ru_stime.tv_usec - before.ru_stime.tv_usec)/1e6;
+    printf("%-8s %10.1f MB/s %8.2f cpu s/GB\n", name, (double)fourbfield(entry, 9)*rounds/elapsed/1e6, cpu/((double)fourbfield(entry, 9)*rounds/1e9));
+}
+
+//drops the image from the page cache so the next read comes from the disk
+void dropCache(void){
+    msync(IM.map, IM.size, MS_SYNC);
+    madvise(IM.map, IM.size, MADV_DONTNEED);
+    posix_fadvise(IM.fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+//copies a file out of the image from a cold page cache three times and prints the throughput
+void benchCold(char *name, char *fp, char *entry){
+    double elapsed = 0, start;
+    int round;
+    for(round=0; round<3; round++){
+        dropCache();
+        start = nowSeconds();
+        transferFile(fp, "diskbench.out", fourbfield(entry, 5), fourbfield(entry, 9), fourbfield(entry, 1));
+        elapsed += nowSeconds() - start;
+    }
+    unlink("diskbench.out");
+    printf("%-8s %10.1f MB/s\n", name, (double)fourbfield(entry, 9)*3/elapsed/1e6);
+}
+
+//benchmarks extent copies against the original block by block diskget loop, then cold copies with and without readahead
+void benchGet(char *fp, char *path){
+    char *entry = findEntry(fp, path);
+    if(entry == NULL || !fileNameMatch(entry, entry+27, 0)){
+        fprintf(stderr, "File not found.\n");
+        exit(1);
+    }
+    benchCopy("blocks", transferBlocks, fp, entry);
+    benchCopy("extents", transferFile, fp, entry);
+    prefetching = 0;
+    benchCold("cold", fp, entry);
+    prefetching = 1;
+    benchCold("cold+ra", fp, entry);
+}
+
+//reads a whole file through the selected backend a buffer at a time
+void readThrough(char *fp, struct diskfile_t *f, char *buf){
+    uint64_t off = 0;
+    int64_t n;
+    while((n = diskRead(fp, f, off, buf, IOBUFSIZE)) > 0){
+        off += n;
+    }
+    if(n < 0){
+        fprintf(stderr, "Corrupt file.\n");
+        exit(1);
+    }
+}
+
+//reads a file through every backend, from a cold page cache and then from a warm one
+void benchIO(char *fp, char *path){
+    struct diskfile_t *f = diskOpen(fp, path);
+    if(f == NULL){
+        fprintf(stderr, "File not found.\n");
+        exit(1);
+    }
+    char *buf = try_malloc(IOBUFSIZE);
+    unsigned b;
+    for(b=0; b<NBACKENDS; b++){
+        IO = &BACKENDS[b];
+        if(IO->init != NULL) IO->init();
+        if(IO != &BACKENDS[b]) continue;//not available here
+        double cold = 0, elapsed, start;
+        int round;
+        for(round=0; round<3; round++){
+            dropCache();
+            start = nowSeconds();
+            readThrough(fp, f, buf);
+            cold += nowSeconds() - start;
+        }
+        long rounds = 0;
+        start = nowSeconds();
+        do{
+            readThrough(fp, f, buf);
+            rounds++;
+            elapsed = nowSeconds() - start;
+        }while(elapsed < 0.5);
+        printf("%-8s cold %10.1f MB/s   warm %10.1f MB/s\n", IO->name, (double)f->size*3/cold/1e6, (double)f->size*rounds/elapsed/1e6);
+    }
+    free(buf);
+    diskClose(f);
+}
+
+//benchmarks the FAT scan kernels against the original byte by byte loop
+void benchFAT(char *fp){
+    char *fat = fp + (long)SB.block_size*SB.FATstart;
+    uint32_t n = (int64_t)SB.FATblocks*SB.block_size/4;
+    benchFATcounter("bytes", countFATbytes, fat, n);
+    benchFATcounter("scalar", countFATscalar, fat, n);
+#if defined(__x86_64__) || defined(__i386__)
+    benchFATcounter("sse2", countFATsse2, fat, n);
+    if(__builtin_cpu_supports("avx2")) benchFATcounter("avx2", countFATavx2, fat, n);
+#endif
+}
+#endif
+
+#if defined(PART6)
+//fragmentation totals over a walk of the directory tree
+struct fragstats_t{
+    uint32_t files;
+    uint32_t fragmented;
+    uint64_t blocks;
+    uint64_t extents;
+};
+
+int reportonly = 0;
+
+//adds one chain to the totals, printing a line for it when verbose
+void fragChain(char *fp, uint32_t start, uint32_t blocks, int isdir, char *path, struct fragstats_t *st, int verbose){
+    struct extent_t *extents;
+    uint32_t n = resolveExtents(fp, start, blocks, &extents);
+    free(extents);
+    st->files++;
+    st->blocks += blocks;
+    st->extents += n;
+    if(n > 1) st->fragmented++;
+    if(verbose){
+        printf("%c %8d blocks %6d extents %8.1f avg run  %s\n", isdir ? 'D' : 'F', blocks, n, n ? (double)blocks/n : 0.0, path);
+    }
+}
+
+//adds every file and directory below a directory to the totals, printing one line each when verbose
+void fragReport(char *fp, uint32_t start, uint32_t numblocks, char *path, struct fragstats_t *st, int verbose){
+    struct diriter_t it;
+    char *entry;
+    char child[4096];
+    dirIterInit(&it, start, numblocks);
+    while((entry = dirIterNext(fp, &it)) != NULL){
+        int isdir = (entry[0] & 7) == 5;
+        if((entry[0] & 3) != 3 && !isdir) continue;
+        snprintf(child, sizeof(child), "%s/%.31s", path, entry+27);
+        fragChain(fp, fourbfield(entry, 1), entryBlocks(entry), isdir, child, st, verbose);
+        if(isdir) fragReport(fp, fourbfield(entry, 1), fourbfield(entry, 5), child, st, verbose);
+    }
+}
+
+//adds the root directory and everything below it to the totals
+void fragImage(char *fp, struct fragstats_t *st, int verbose){
+    fragChain(fp, SB.rootstart, SB.root_block_count, 1, "/", st, verbose);
+    fragReport(fp, SB.rootstart, SB.root_block_count, "", st, verbose);
+}
+
+//prints the whole-image fragmentation totals
+void printFragStats(struct fragstats_t *st){
+    printf("Files: %d\n", st->files);
+    printf("Fragmented files: %d\n", st->fragmented);
+    printf("Blocks: %llu\n", (unsigned long long)st->blocks);
+    printf("Extents: %llu\n", (unsigned long long)st->extents);
+    printf("Average run: %.1f blocks\n", st->extents ? (double)st->blocks/st->extents : 0.0);
+}
+
+//moves a chain of blocks whose first block is stored at startfield into one free run if one is big
+//enough. data is copied first, then the new chain and start block are written and only then is the
+//old chain freed. returns 1 if the chain moved
+int relocateRun(char *fp, char *startfield, uint32_t blocks, int isdir){
+    struct extent_t *extents;
+    uint32_t n = resolveExtents(fp, fourbfield(startfield, 0), blocks, &extents);
+    if(n <= 1){
+        free(extents);
+        return 0;
+    }
+    uint32_t total = 0;
+    uint32_t i, k;
+    for(i=0; i<n; i++){
+        total += extents[i].count;
+    }
+    uint32_t len;
+    uint32_t start = bestFitRun(total, &len);
+    if(start >= FM.nblocks || len < total){
+        free(extents);
+        return 0;
+    }
+    claimAt(start, total);
+    uint32_t dest = start;
+    for(i=0; i<n; i++){
+        memcpy(fp+(long)dest*SB.block_size, fp+(long)extents[i].start*SB.block_size, (long)extents[i].count*SB.block_size);
+        dest += extents[i].count;
+    }
+    STAT(blocks, total);
+    STAT(bytes, (uint64_t)total*SB.block_size);
+    for(k=0; k+1<total; k++){
+        fatSet(fp, start+k, start+k+1);
+    }
+    fatSet(fp, start+total-1, 0xFFFFFFFF);
+    if(isdir) DIRgen++;//the directory's entries moved
+    uint32_t temp = htonl(start);
+    journalTouch(startfield, 4);
+    memcpy(startfield, &temp, 4);
+    for(i=0; i<n; i++){
+        for(k=0; k<extents[i].count; k++){
+            fatSet(fp, extents[i].start+k, 0);
+        }
+        releaseRun(extents[i].start, extents[i].count);
+    }
+    free(extents);
+    return 1;
+}
+
+//moves the chain of a directory entry into one free run
+int relocateChain(char *fp, char *entry){
+    return relocateRun(fp, entry+1, entryBlocks(entry), (entry[0] & 7) == 5);
+}
+
+//moves the root directory's chain into one free run, with its new start written to the superblock
+int relocateRoot(char *fp){
+    if(!relocateRun(fp, fp+22, SB.root_block_count, 1)) return 0;
+    SB.rootstart = fourbfield(fp, 22);
+    return 1;
+}
+
+//makes every file and directory below a directory contiguous. directories are moved before
+//their entries are visited so the walk always reads them from their final place
+void defragDir(char *fp, uint32_t start, uint32_t numblocks, uint32_t *moved){
+    struct diriter_t it;
+    char *entry;
+    dirIterInit(&it, start, numblocks);
+    while((entry = dirIterNext(fp, &it)) != NULL){
+        int isdir = (entry[0] & 7) == 5;
+        if((entry[0] & 3) != 3 && !isdir) continue;
+        *moved += relocateChain(fp, entry);
+        if(isdir) defragDir(fp, fourbfield(entry, 1), fourbfield(entry, 5), moved);
+    }
+}
+
+//reports fragmentation and, unless only a report was asked for, defragments the image, the root
+//directory's own chain included. files that don't fit in any free run are retried after each pass
+//since the pass frees their old blocks
+void defragImage(char *fp){
+    struct fragstats_t st;
+    memset(&st, 0, sizeof(st));
+    if(reportonly){
+        fragImage(fp, &st, 1);
+        printf("\n");
+        printFragStats(&st);
+        return;
+    }
+    fragImage(fp, &st, 0);
+    printf("Before:\n");
+    printFragStats(&st);
+    if(FM.bits == NULL) buildFreeMap(fp);
+    uint32_t moved, total = 0;
+    int pass;
+    for(pass=0; pass<8; pass++){
+        moved = relocateRoot(fp);
+        defragDir(fp, SB.rootstart, SB.root_block_count, &moved);
+        journalCommit();//lets the next pass reuse the blocks this one freed
+        total += moved;
+        if(moved == 0) break;
+    }
+    writeSummary();
+    memset(&st, 0, sizeof(st));
+    fragImage(fp, &st, 0);
+    printf("\nAfter (%d chains moved):\n", total);
+    printFragStats(&st);
+}
+#endif
+
+#if defined(PART5)
+//number of writes between metadata flushes in batch mode. 0 flushes only at the end
+long checkpoint = 0;
+int persistindex = 0;
+
+//directory indexes saved next to the image by diskbatch --dirindex. like the FAT summary they are
+//only trusted while the image still has the size and mtime recorded here
+#define DIRINDEXMAGIC 0x58444946
+struct dirindexhead_t{
+    uint32_t magic;
+    uint32_t count;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+};
+
+struct dirindexrec_t{
+    uint32_t start;
+    uint32_t mask;
+    uint32_t used;
+    uint32_t nfree;
+    uint32_t last;
+};
+
+//writes every directory index built so far to the sidecar. failures are ignored since it's only a cache
+void saveDirIndexes(void){
+    char path[4096], temp[4096];
+    struct dirindexhead_t head;
+    struct stat sf;
+    struct dirindex_t *d;
+    int fd, i;
+    fstat(IM.fd, &sf);
+    memset(&head, 0, sizeof(head));
+    head.magic = DIRINDEXMAGIC;
+    head.ino = sf.st_ino;
+    head.size = sf.st_size;
+    head.mtime_sec = sf.st_mtim.tv_sec;
+    head.mtime_nsec = sf.st_mtim.tv_nsec;
+    for(i=0; i<DIRINDEXBUCKETS; i++){
+        for(d=DI[i]; d!=NULL; d=d->next){
+            if(d->gen == DIRgen) head.count++;
+        }
+    }
+    snprintf(path, sizeof(path), "%s.fidx", IM.name);
+    snprintf(temp, sizeof(temp), "%s.fidx.tmp", IM.name);
+    if((fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) return;
+    FILE *out = fdopen(fd, "wb");
+    fwrite(&head, sizeof(head), 1, out);
+    for(i=0; i<DIRINDEXBUCKETS; i++){
+        for(d=DI[i]; d!=NULL; d=d->next){
+            if(d->gen != DIRgen) continue;
+            struct dirindexrec_t rec = {d->start, d->mask, d->used, d->nfree-d->freehead, d->last};
+            fwrite(&rec, sizeof(rec), 1, out);
+            fwrite(d->slots, sizeof(uint64_t), d->mask+1, out);
+            fwrite(d->free+d->freehead, sizeof(uint64_t), rec.nfree, out);
+        }
+    }
+    if(fclose(out) == 0){
+        rename(temp, path);
+    }else{
+        unlink(temp);
+    }
+}
+
+//loads the directory indexes saved by an earlier batch if the image hasn't changed since
+void loadDirIndexes(void){
+    char path[4096];
+    struct dirindexhead_t head;
+    struct stat sf;
+    uint32_t i;
+    snprintf(path, sizeof(path), "%s.fidx", IM.name);
+    FILE *in = fopen(path, "rb");
+    if(in == NULL) return;
+    fstat(IM.fd, &sf);
+    if(fread(&head, sizeof(head), 1, in) != 1 || head.magic != DIRINDEXMAGIC || head.ino != sf.st_ino || head.size != sf.st_size
+        || head.mtime_sec != sf.st_mtim.tv_sec || head.mtime_nsec != sf.st_mtim.tv_nsec){
+        fclose(in);
+        return;
+    }
+    for(i=0; i<head.count; i++){
+        struct dirindexrec_t rec;
+        if(fread(&rec, sizeof(rec), 1, in) != 1) break;
+        struct dirindex_t *d = try_malloc(sizeof(struct dirindex_t));
+        d->start = rec.start;
+        d->gen = DIRgen;
+        d->mask = rec.mask;
+        d->used = rec.used;
+        d->nfree = rec.nfree;
+        d->freehead = 0;
+        d->freecap = rec.nfree;
+        d->last = rec.last;
+        d->slots = try_malloc((d->mask+1)*sizeof(uint64_t));
+        d->free = try_malloc((rec.nfree+1)*sizeof(uint64_t));
+        if(fread(d->slots, sizeof(uint64_t), d->mask+1, in) != d->mask+1 || fread(d->free, sizeof(uint64_t), rec.nfree, in) != rec.nfree){
+            free(d->slots);
+            free(d->free);
+            free(d);
+            break;
+        }
+        d->next = DI[d->start%DIRINDEXBUCKETS];
+        DI[d->start%DIRINDEXBUCKETS] = d;
+    }
+    fclose(in);
+}
+
+//runs one operation per line of the script against the already open image.
+//stops at the first failing operation like the single tools do
+void runBatch(char *script, char *fp){
+    FILE *in = stdin;
+    if(strcmp(script, "-") && (in = fopen(script, "r")) == NULL){
+        fprintf(stderr, "Can't open batch script.\n");
+        exit(1);
+    }
+    if(persistindex) loadDirIndexes();
+    char *line = NULL;
+    size_t cap = 0;
+    long lineno = 0;
+    long writes = 0;
+    while(getline(&line, &cap, in) > 0){
+        lineno++;
+        char *args[4];
+        char *save;
+        int n = 0;
+        char *tok = strtok_r(line, " \t\r\n", &save);
+        while(tok != NULL && n < 4){
+            args[n++] = tok;
+            tok = strtok_r(NULL, " \t\r\n", &save);
+        }
+        if(n == 0 || args[0][0] == '#') continue;
+        if(!strcmp(args[0], "info") && n == 1){
+            printDiskInfo(stdout);
+        }else if(!strcmp(args[0], "list") && n == 2){
+            printDirInfo(args[1], fp, SB.rootstart, SB.root_block_count);
+        }else if(!strcmp(args[0], "get") && n == 3){
+            getFile(args[1], fp, SB.rootstart, SB.root_block_count, args[2]);
+        }else if(!strcmp(args[0], "put") && n == 3){
+            putFile(args[1], args[2], fp, stdout);
+            if(checkpoint > 0 && ++writes%checkpoint == 0) writeSummary();
+        }else if(!strcmp(args[0], "mv") && n == 3){
+            moveEntry(args[1], args[2], fp);
+            if(checkpoint > 0 && ++writes%checkpoint == 0) writeSummary();
+        }else if(!strcmp(args[0], "rm") && (n == 2 || (n == 3 && !strcmp(args[1], "-r")))){
+            removeEntry(args[n-1], fp, n == 3);
+            if(checkpoint > 0 && ++writes%checkpoint == 0) writeSummary();
+        }else if(!strcmp(args[0], "sync") && n == 1){
+            writeSummary();
+        }else{
+            fprintf(stderr, "Line %ld: unknown operation or wrong arguments.\n", lineno);
+            exit(1);
+        }
+        fflush(stdout);
+    }
+    free(line);
+    if(in != stdin) fclose(in);
+    writeSummary();
+    if(persistindex) saveDirIndexes();
+}
+#endif
+
+#if defined(PART7)
+//kinds of problem diskcheck reports
+#define CROSSLINKED 0
+#define LOOPING 1
+#define BROKEN 2
+#define LENGTH 3
+#define COUNTFIELD 4
+
+//a problem found with the chain of one directory entry. entry is the image offset of the entry,
+//or -1 for the root directory
+struct problem_t{
+    int kind;
+    char *path;
+    long entry;
+    uint32_t block;
+    uint32_t have;
+    uint32_t want;
+};
+
+//shared state of a check. used has a bit per block reached from a directory entry and cross a bit per
+//block reached more than once. both are set with atomic ors by all the workers
+struct check_t{
+    uint64_t *used;
+    uint64_t *cross;
+    uint32_t nblocks;
+    uint32_t files;
+    uint32_t dirs;
+    uint64_t blocks;
+    uint32_t orphans;
+    uint32_t firstorphan;
+    struct problem_t *problems;
+    long nproblems;
+    long cap;
+    pthread_mutex_t lock;
+};
+
+struct check_t CK;
+int repair = 0;
+
+//records a problem
+void addProblem(int kind, char *path, long entry, uint32_t block, uint32_t have, uint32_t want){
+    pthread_mutex_lock(&CK.lock);
+    if(CK.nproblems == CK.cap){
+        CK.cap = CK.cap ? CK.cap*2 : 64;
+        struct problem_t *grown = try_malloc(CK.cap*sizeof(struct problem_t));
+        if(CK.nproblems > 0) memcpy(grown, CK.problems, CK.nproblems*sizeof(struct problem_t));
+        free(CK.problems);
+        CK.problems = grown;
+    }
+    struct problem_t *p = &CK.problems[CK.nproblems++];
+    p->kind = kind;
+    p->path = strdup(path);
+    p->entry = entry;
+    p->block = block;
+    p->have = have;
+    p->want = want;
+    pthread_mutex_unlock(&CK.lock);
+}
+
+//marks a block as reached. returns 0 if something else had already reached it
+int markBlock(uint32_t block){
+    if(visitMark(CK.used, block)) return 1;
+    visitMark(CK.cross, block);
+    return 0;
+}
+
+//whether a block is reached from more than one place
+int isCross(uint32_t block){
+    return (__atomic_load_n(&CK.cross[block/64], __ATOMIC_RELAXED) >> (block%64)) & 1;
+}
+
+//whether block is one of the first len blocks of the chain from start
+int inChain(char *fp, uint32_t start, uint32_t len, uint32_t block){
+    uint32_t i;
+    for(i=0; i<len; i++){
+        if(start == block) return 1;
+        start = fatGet(fp, start);
+    }
+    return 0;
+}
+
+//walks a chain, marking its blocks, and records crosslinks, loops and links to blocks that aren't
+//allocated. the first block found already marked is either where the chain loops back on itself or
+//where it joins another chain, and walking the chain again up to it tells which. Brent's algorithm
+//catches any later loop without memory per chain. returns the number of blocks walked and whether
+//the first block was reached first from here
+uint32_t checkChain(char *fp, uint32_t start, char *path, long entry, int *owner){
+    uint32_t len = 0, power = 1, lam = 0;
+    uint32_t tortoise = start, cur = start;
+    int crossed = 0;
+    *owner = 1;
+    while(1){
+        uint32_t v = cur < CK.nblocks ? fatGet(fp, cur) : 0;
+        if(v == 0 || v == 1){//the link into cur points at a free or reserved block, or outside the FAT
+            addProblem(BROKEN, path, entry, cur, len, 0);
+            return len;
+        }
+        if(!crossed && !markBlock(cur)){
+            if(inChain(fp, start, len, cur)){
+                addProblem(LOOPING, path, entry, cur, len, 0);
+                return len;
+            }
+            if(len == 0) *owner = 0;
+            addProblem(CROSSLINKED, path, entry, cur, len, 0);
+            crossed = 1;
+        }else if(crossed){
+            markBlock(cur);
+        }
+        len++;
+        if(v == 0xFFFFFFFF) return len;
+        cur = v;
+        if(cur == tortoise){
+            addProblem(LOOPING, path, entry, cur, len, 0);
+            return len;
+        }
+        if(++lam == power){
+            tortoise = cur;
+            power *= 2;
+            lam = 0;
+        }
+    }
+}
+
+//a directory to check
+struct checktask_t{
+    char *path;
+    uint32_t start;
+    uint32_t numblocks;
+};
+
+//checks the chain of every entry of a directory and queues the subdirectories. a directory whose
+//first block was already reached from elsewhere isn't descended into, which stops directory cycles
+void checkTask(void *arg, int worker){
+    struct checktask_t *t = arg;
+    char *fp = IM.map;
+    struct diriter_t it;
+    char *entry;
+    char path[4096];
+    dirIterInit(&it, t->start, t->numblocks);
+    while((entry = dirIterNext(fp, &it)) != NULL){
+        int isdir = (entry[0] & 7) == 5;
+        if((entry[0] & 3) != 3 && !isdir) continue;
+        snprintf(path, sizeof(path), "%s/%.31s", t->path, entry+27);
+        uint32_t start = fourbfield(entry, 1);
+        uint32_t numblocks = fourbfield(entry, 5);
+        uint32_t size = fourbfield(entry, 9);
+        uint32_t want = isdir ? numblocks : size/SB.block_size + (size%SB.block_size == 0 ? 0 : 1);
+        uint32_t len = 0;
+        int owner = 1;
+        if(want > 0 || start < CK.nblocks) len = checkChain(fp, start, path, entry-fp, &owner);
+        if(len != want){
+            addProblem(LENGTH, path, entry-fp, start, len, want);
+        }else if(!isdir && numblocks != 0 && numblocks != len){//older diskputs left 0 for small files
+            addProblem(COUNTFIELD, path, entry-fp, start, numblocks, len);
+        }
+        if(isdir){
+            __atomic_fetch_add(&CK.dirs, 1, __ATOMIC_RELAXED);
+            if(!owner || len == 0) continue;
+            struct checktask_t *child = try_malloc(sizeof(struct checktask_t));
+            child->path = strdup(path);
+            child->start = start;
+            child->numblocks = len < numblocks ? len : numblocks;
+            poolSubmit(worker, checkTask, child);
+        }else{
+            __atomic_fetch_add(&CK.files, 1, __ATOMIC_RELAXED);
+        }
+        __atomic_fetch_add(&CK.blocks, len, __ATOMIC_RELAXED);
+    }
+    free(t->path);
+    free(t);
+}
+
+//a range of the FAT to scan for orphans
+struct orphantask_t{
+    uint32_t from;
+    uint32_t to;
+};
+
+//counts blocks allocated in the FAT that no chain reached
+void orphanTask(void *arg, int worker){
+    struct orphantask_t *t = arg;
+    char *fp = IM.map;
+    uint32_t b, count = 0, first = 0xFFFFFFFF;
+    for(b=t->from; b<t->to; b++){
+        if(CK.used[b/64] >> (b%64) & 1) continue;
+        uint32_t v = fatGet(fp, b);
+        if(v != 0 && v != 1){
+            if(count++ == 0) first = b;
+        }
+    }
+    pthread_mutex_lock(&CK.lock);
+    CK.orphans += count;
+    if(first < CK.firstorphan) CK.firstorphan = first;
+    pthread_mutex_unlock(&CK.lock);
+    free(t);
+}
+
+int compareProblems(const void *a, const void *b){
+    const struct problem_t *x = a, *y = b;
+    int c = strcmp(x->path, y->path);
+    return c ? c : x->kind - y->kind;
+}
+
+//checks the whole image: the root chain first, then every directory in parallel, then the FAT for
+//orphaned blocks in parallel. returns the number of problems found
+long checkImage(char *fp){
+    uint32_t entries = (int64_t)SB.FATblocks*SB.block_size/4;
+    long i;
+    CK.nblocks = SB.block_count < entries ? SB.block_count : entries;
+    long words = (CK.nblocks+63)/64;
+    CK.used = try_malloc(words*sizeof(uint64_t));
+    CK.cross = try_malloc(words*sizeof(uint64_t));
+    memset(CK.used, 0, words*sizeof(uint64_t));
+    memset(CK.cross, 0, words*sizeof(uint64_t));
+    for(i=0; i<CK.nproblems; i++){
+        free(CK.problems[i].path);
+    }
+    CK.nproblems = 0;
+    CK.files = CK.dirs = CK.orphans = 0;
+    CK.blocks = 0;
+    CK.firstorphan = 0xFFFFFFFF;
+    pthread_mutex_init(&CK.lock, NULL);
+    uint32_t rootblocks = fourbfield(fp, 26);
+    int owner;
+    uint32_t len = checkChain(fp, SB.rootstart, "/", -1, &owner);
+    if(len != rootblocks) addProblem(LENGTH, "/", -1, SB.rootstart, len, rootblocks);
+    CK.blocks += len;
+    poolInit();
+    struct checktask_t *t = try_malloc(sizeof(struct checktask_t));
+    t->path = strdup("");
+    t->start = SB.rootstart;
+    t->numblocks = len < rootblocks ? len : rootblocks;
+    poolSubmit(0, checkTask, t);
+    poolRun();
+    uint32_t b;
+    for(b=0; b<CK.nblocks; b+=1<<16){
+        struct orphantask_t *o = try_malloc(sizeof(struct orphantask_t));
+        o->from = b;
+        o->to = CK.nblocks-b < (1<<16) ? CK.nblocks : b+(1<<16);
+        poolSubmit(b/(1<<16)%POOL.nworkers, orphanTask, o);
+    }
+    poolRun();
+    qsort(CK.problems, CK.nproblems, sizeof(struct problem_t), compareProblems);
+    return CK.nproblems + (CK.orphans > 0);
+}
+
+//prints what a check found
+void printProblems(void){
+    long i;
+    for(i=0; i<CK.nproblems; i++){
+        struct problem_t *p = &CK.problems[i];
+        if(p->kind == CROSSLINKED){
+            printf("%s: crosslinked at block %u\n", p->path, p->block);
+        }else if(p->kind == LOOPING){
+            printf("%s: chain loops back to block %u\n", p->path, p->block);
+        }else if(p->kind == BROKEN){
+            printf("%s: chain broken at block %u after %u blocks\n", p->path, p->block, p->have);
+        }else if(p->kind == LENGTH){
+            printf("%s: chain has %u blocks, entry needs %u\n", p->path, p->have, p->want);
+        }else{
+            printf("%s: entry records %u blocks, chain has %u\n", p->path, p->have, p->want);
+        }
+    }
+    if(CK.orphans > 0) printf("%u orphaned blocks, the first at block %u\n", CK.orphans, CK.firstorphan);
+}
+
+//rewrites the start, block count and size fields of an entry, or of the root directory for -1
+void setEntryFields(char *fp, long entry, uint32_t start, uint32_t numblocks, uint32_t size){
+    uint32_t temp;
+    if(entry < 0){
+        journalTouch(fp+26, 8);
+        temp = htonl(numblocks);
+        memcpy(fp+26, &temp, 4);
+        SB.root_block_count = numblocks;
+        return;
+    }
+    journalTouch(fp+entry+1, 12);
+    temp = htonl(start);
+    memcpy(fp+entry+1, &temp, 4);
+    temp = htonl(numblocks);
+    memcpy(fp+entry+5, &temp, 4);
+    temp = htonl(size);
+    memcpy(fp+entry+9, &temp, 4);
+}
+
+//repairs the chain of one entry. with cutonly the chain is only cut where it loops or links to a block that
+//isn't allocated, which is done for every entry before any block is claimed. otherwise blocks past the
+//end of the file are freed, the entry's fields are made to agree with what is left, and with clone the
+//entry found its chain shared with one walked earlier: a file gets its own copy of the shared blocks,
+//while a directory is a duplicate entry and is removed. a file whose chain has to be cut inside shared
+//blocks gets its own copies too, so the cut doesn't end the other chain
+void repairEntry(char *fp, struct problem_t *p, uint64_t *seen, int clone, int cutonly){
+    int isdir = p->entry < 0 || (fp[p->entry] & 7) == 5;
+    uint32_t start = p->entry < 0 ? SB.rootstart : fourbfield(fp, p->entry+1);
+    uint32_t size = p->entry < 0 ? 0 : fourbfield(fp, p->entry+9);
+    uint32_t want = p->entry < 0 ? fourbfield(fp, 26) : isdir ? fourbfield(fp, p->entry+5) : size/SB.block_size + (size%SB.block_size == 0 ? 0 : 1);
+    if(!cutonly && clone && isdir && p->entry >= 0){
+        journalTouch(fp+p->entry, 1);
+        fp[p->entry] = 0;
+        DIRgen++;
+        return;
+    }
+    uint32_t prev = 0xFFFFFFFF, cur = start, len = 0;
+    uint32_t first = start;
+    if(!cutonly && !isdir && want > 0){
+        while(cur < CK.nblocks && ++len < want) cur = fatGet(fp, cur);
+        if(cur < CK.nblocks && len == want && isCross(cur) && fatGet(fp, cur) != 0xFFFFFFFF) clone = 1;
+        cur = start;
+        len = 0;
+    }
+    while(cur < CK.nblocks){
+        uint32_t v = fatGet(fp, cur);
+        if(v == 0 || v == 1 || (seen[cur/64] >> (cur%64) & 1)){//cut before cur
+            if(prev == 0xFFFFFFFF) first = 0xFFFFFFFF;
+            else fatSet(fp, prev, 0xFFFFFFFF);
+            break;
+        }
+        seen[cur/64] |= 1ULL << (cur%64);
+        if(!cutonly && !isdir && len == want){//past the end of the file
+            if(prev == 0xFFFFFFFF) first = 0xFFFFFFFF;
+            else fatSet(fp, prev, 0xFFFFFFFF);
+            while(!isCross(cur)){//free the tail up to a block something else also uses
+                fatSet(fp, cur, 0);
+                releaseRun(cur, 1);
+                if(v == 0xFFFFFFFF || v >= CK.nblocks || (seen[v/64] >> (v%64) & 1)) break;
+                cur = v;
+                seen[cur/64] |= 1ULL << (cur%64);
+                v = fatGet(fp, cur);
+                if(v == 0 || v == 1) break;
+            }
+            break;
+        }
+        if(!cutonly && clone && p->entry >= 0 && isCross(cur)){//copy the shared block
+            uint32_t copy = claimBlock();
+            CK.used[copy/64] |= 1ULL << (copy%64);//not an orphan
+            memcpy(fp+(long)copy*SB.block_size, fp+(long)cur*SB.block_size, SB.block_size);
+            fatSet(fp, copy, v);
+            if(prev == 0xFFFFFFFF) first = copy;
+            else fatSet(fp, prev, copy);
+            cur = copy;
+        }
+        prev = cur;
+        len++;
+        if(v == 0xFFFFFFFF || v >= CK.nblocks){
+            if(v != 0xFFFFFFFF) fatSet(fp, cur, 0xFFFFFFFF);
+            break;
+        }
+        cur = v;
+    }
+    if(cutonly){//an entry left pointing at a free block would pick up whatever is claimed there next
+        if(first == 0xFFFFFFFF && start != 0xFFFFFFFF) setEntryFields(fp, p->entry, 0xFFFFFFFF, 0, 0);
+        return;
+    }
+    if(len == 0) first = 0xFFFFFFFF;
+    if(isdir){
+        setEntryFields(fp, p->entry, first, len, len*SB.block_size);
+    }else{
+        setEntryFields(fp, p->entry, first, len, size < (uint64_t)len*SB.block_size ? size : len*SB.block_size);
+    }
+}
+
+//frees every block allocated in the FAT that no chain reaches
+void freeOrphans(char *fp){
+    uint32_t b;
+    for(b=0; b<CK.nblocks; b++){
+        if(CK.used[b/64] >> (b%64) & 1) continue;
+        uint32_t v = fatGet(fp, b);
+        if(v != 0 && v != 1){
+            fatSet(fp, b, 0);
+            releaseRun(b, 1);
+        }
+    }
+}
+
+//checks the image and, with --repair, fixes what was found and checks again until it is clean
+void diskCheck(char *fp){
+    double start = nowSeconds();
+    long found = checkImage(fp);
+    printProblems();
+    printf("Checked %u directories, %u files, %llu blocks in %.2f s: %ld problem%s\n", CK.dirs, CK.files, (unsigned long long)CK.blocks,
+        nowSeconds()-start, found, found == 1 ? "" : "s");
+    int round;
+    for(round=0; repair && found > 0 && round<4; round++){
+        if(FM.bits == NULL) buildFreeMap(fp);
+        long words = (CK.nblocks+63)/64;
+        uint64_t *seen = try_malloc(words*sizeof(uint64_t));
+        long i;
+        int pass;
+        for(pass=0; pass<2; pass++){//cut every chain before any blocks are claimed for copies
+            for(i=0; i<CK.nproblems; i++){
+                if(i > 0 && CK.problems[i].entry == CK.problems[i-1].entry) continue;
+                memset(seen, 0, words*sizeof(uint64_t));
+                repairEntry(fp, &CK.problems[i], seen, CK.problems[i].kind == CROSSLINKED, pass == 0);//sorted first for its entry
+            }
+        }
+        free(seen);
+        freeOrphans(fp);
+        journalCommit();
+        found = checkImage(fp);
+        printf("After repair: %ld problem%s\n", found, found == 1 ? "" : "s");
+        printProblems();
+        IM.rescan = 1;
+    }
+    if(IM.rescan) readFATinfo(fp);//recount after repairs
+    writeSummary();
+    if(found > 0) exit(1);
+}
+#endif
+
+#if defined(PART8)
+//search filters of diskfind. the pattern is a glob when it has any of *?[ and a substring otherwise, and
+//it is matched against the whole path when it has a / and against the name otherwise. dates are compared
+//as stored, packed as yyyymmddhhmmss, against the entry's modification time
+#define ANYTYPE 0
+#define FILESONLY 3
+#define DIRSONLY 5
+struct findfilter_t{
+    char *pattern;
+    int glob;
+    int wholepath;
+    int type;
+    int64_t minsize;
+    int64_t maxsize;
+    uint64_t after;
+    uint64_t before;
+    int details;
+};
+
+struct findfilter_t FF = {NULL, 0, 0, ANYTYPE, -1, -1, 0, 0, 0};
+
+//a directory still to be searched
+struct findtask_t{
+    char *path;
+    uint32_t start;
+    uint32_t numblocks;
+};
+
+//matches found by a worker, written out a directory at a time
+#define FINDBUFSIZE (64*1024)
+struct findbuf_t{
+    char *text;
+    long len;
+};
+
+struct findbuf_t *FBUF;
+pthread_mutex_t findlock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t FOUND = 0;
+
+//parses a size with an optional k, M or G suffix
+int64_t parseSize(char *text){
+    char *end;
+    int64_t n = strtoll(text, &end, 10);
+    if(*end == 'k' || *end == 'K') n <<= 10;
+    else if(*end == 'M') n <<= 20;
+    else if(*end == 'G') n <<= 30;
+    else if(*end != '\0') n = -1;
+    if(n < 0){
+        fprintf(stderr, "Bad size %s\n", text);
+        exit(1);
+    }
+    return n;
+}
+
+//parses YYYY-MM-DD with an optional time as HH:MM:SS after a space or T into its packed form
+uint64_t parseDate(char *text){
+    int year, month, day, hour = 0, min = 0, sec = 0;
+    int n = sscanf(text, "%d-%d-%d%*[ T]%d:%d:%d", &year, &month, &day, &hour, &min, &sec);
+    if(n != 3 && n != 6){
+        fprintf(stderr, "Bad date %s (YYYY-MM-DD or YYYY-MM-DDTHH:MM:SS)\n", text);
+        exit(1);
+    }
+    return year*10000000000ULL + month*100000000ULL + day*1000000ULL + hour*10000ULL + min*100ULL + sec;
+}
+
+//packed modification time of a directory entry
+uint64_t entryDate(char *entry){
+    return twobfield(entry, 20)*10000000000ULL + onebfield(entry, 22)*100000000ULL + onebfield(entry, 23)*1000000ULL
+        + onebfield(entry, 24)*10000ULL + onebfield(entry, 25)*100ULL + onebfield(entry, 26);
+}
+
+//checks an entry named name at path against every filter
+int findMatch(char *entry, char *name, char *path){
+    int isdir = (entry[0] & 7) == 5;
+    if(FF.type == FILESONLY && isdir) return 0;
+    if(FF.type == DIRSONLY && !isdir) return 0;
+    if(FF.minsize >= 0 || FF.maxsize >= 0){
+        uint32_t size = fourbfield(entry, 9);
+        if(FF.minsize >= 0 && size < FF.minsize) return 0;
+        if(FF.maxsize >= 0 && size > FF.maxsize) return 0;
+    }
+    if(FF.after || FF.before){
+        uint64_t date = entryDate(entry);
+        if(FF.after && date < FF.after) return 0;
+        if(FF.before && date > FF.before) return 0;
+    }
+    if(FF.pattern == NULL) return 1;
+    char *subject = FF.wholepath ? path : name;
+    return FF.glob ? !fnmatch(FF.pattern, subject, 0) : strstr(subject, FF.pattern) != NULL;
+}
+
+//writes out what a worker has found so far
+void findFlush(struct findbuf_t *b){
+    if(b->len == 0) return;
+    pthread_mutex_lock(&findlock);
+    writeAll(STDOUT_FILENO, b->text, b->len);
+    pthread_mutex_unlock(&findlock);
+    b->len = 0;
+}
+
+//searches one directory, adding its matches to the worker's buffer and queueing its subdirectories
+void findTask(void *arg, int worker){
+    struct findtask_t *t = arg;
+    struct findbuf_t *b = &FBUF[worker];
+    char *fp = IM.map;
+    if(!visitDir(t->start)) dirCycle(t->path);
+    struct diriter_t it;
+    char *entry;
+    char name[FILENAMELIM+1];
+    char path[4096];
+    long plen = strlen(t->path);
+    uint64_t found = 0;
+    memcpy(path, t->path, plen);
+    if(plen > 1) path[plen++] = '/';
+    dirIterInit(&it, t->start, t->numblocks);
+    while((entry = dirIterNext(fp, &it)) != NULL){
+        if((entry[0] & 3) != 3 && (entry[0] & 7) != 5) continue;
+        memcpy(name, entry+27, FILENAMELIM);
+        name[FILENAMELIM] = '\0';
+        long nlen = strlen(name);
+        if(nlen == 0 || plen+nlen >= sizeof(path)) continue;
+        memcpy(path+plen, name, nlen+1);
+        if(findMatch(entry, name, path)){
+            if(b->len+plen+nlen+64 > FINDBUFSIZE) findFlush(b);
+            if(FF.details){
+                b->len += sprintf(b->text+b->len, "%c %10u %4d/%02d/%02d %2d:%02d:%02d %s\n", (entry[0] & 7) == 5 ? 'D' : 'F', fourbfield(entry, 9),
+                    twobfield(entry, 20), onebfield(entry, 22), onebfield(entry, 23), (onebfield(entry, 24)+17)%24, onebfield(entry, 25), onebfield(entry, 26), path);
+            }else{
+                b->len += sprintf(b->text+b->len, "%s\n", path);
+            }
+            found++;
+        }
+        if((entry[0] & 7) == 5){
+            struct findtask_t *child = try_malloc(sizeof(struct findtask_t));
+            child->path = strdup(path);
+            child->start = fourbfield(entry, 1);
+            child->numblocks = fourbfield(entry, 5);
+            poolSubmit(worker, findTask, child);
+        }
+    }
+    findFlush(b);
+    __atomic_fetch_add(&FOUND, found, __ATOMIC_RELAXED);
+    free(t->path);
+    free(t);
+}
+
+//searches the tree below a directory for entries passing the filters. directories are searched in parallel
+//by the worker pool and matches are written out as each directory is done, so the order isn't fixed
+void findEntries(char *pattern, char *dirname, char *fp){
+    struct findtask_t *t = try_malloc(sizeof(struct findtask_t));
+    char *entry = findEntry(fp, dirname);
+    if(entry != NULL && (entry[0] & 7) == 5){
+        t->start = fourbfield(entry, 1);
+        t->numblocks = fourbfield(entry, 5);
+    }else if(dirname[0] == '/' && strspn(dirname, "/") == strlen(dirname)){
+        t->start = SB.rootstart;
+        t->numblocks = SB.root_block_count;
+        dirname = "/";
     }else{
-        fprintf(stderr, "Must specify a disc image.\n");
+        fprintf(stderr, "Directory not found.\n");
+        exit(1);
+    }
+    if(pattern[0] != '\0'){
+        FF.pattern = pattern;
+        FF.glob = strpbrk(pattern, "*?[") != NULL;
+        FF.wholepath = strchr(pattern, '/') != NULL;
+    }
+    t->path = strdup(dirname);
+    poolInit();
+    visitInit();
+    FBUF = try_malloc(POOL.nworkers*sizeof(struct findbuf_t));
+    int w;
+    for(w=0; w<POOL.nworkers; w++){
+        FBUF[w].text = try_malloc(FINDBUFSIZE);
+        FBUF[w].len = 0;
+    }
+    poolSubmit(0, findTask, t);
+    poolRun();
+    if(FOUND == 0) exit(1);
+}
+#endif
+
+#if defined(PART9)
+//diskd keeps an image open and serves requests over a unix socket, one thread per connection. a request
+//is a line of tab separated words: info, list [directory], stat [path], get [file] or put [path] [size]
+//followed by size bytes of data. every reply is OK or ERR and the length of the body, then the body.
+//readers share the image under a read lock. a put takes the write lock and runs in the daemon itself, so the
+//free map, run index and directory indexes it updates stay warm. a request that would make the put exit is
+//turned away by putCheck first; only I/O errors and a corrupt image still end the daemon, as they do any tool
+int serving = 1;
+pthread_rwlock_t imagelock = PTHREAD_RWLOCK_INITIALIZER;
+
+//sends a whole buffer. returns -1 if the client has gone away
+int sendAll(int fd, char *buf, long len){
+    while(len > 0){
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+//sends a reply with a text body
+int reply(int fd, int ok, char *text, long len){
+    char head[64];
+    int n = sprintf(head, "%s %ld\n", ok ? "OK" : "ERR", len);
+    if(sendAll(fd, head, n) < 0) return -1;
+    return sendAll(fd, text, len);
+}
+
+//finds the directory a list request names. returns 0 if it isn't a directory
+int lookupDir(char *fp, char *path, uint32_t *start, uint32_t *numblocks){
+    char *entry = findEntry(fp, path);
+    if(entry != NULL && (entry[0] & 7) == 5){
+        *start = fourbfield(entry, 1);
+        *numblocks = fourbfield(entry, 5);
+        return 1;
+    }
+    if(path[0] == '/' && strspn(path, "/") == strlen(path)){
+        *start = SB.rootstart;
+        *numblocks = SB.root_block_count;
+        return 1;
+    }
+    return 0;
+}
+
+//answers a request that only reads the image. the read lock must be held
+int serveRead(int fd, char **args, int n){
+    char *fp = IM.map;
+    char *text;
+    size_t len;
+    int ok = 1;
+    if(!strcmp(args[0], "get") && n == 2){
+        char *entry = findEntry(fp, args[1]);
+        if(entry == NULL || !fileNameMatch(entry, entry+27, 0)) return reply(fd, 0, "File not found.\n", 16);
+        struct extent_t *extents;
+        uint32_t size = fourbfield(entry, 9);
+        uint32_t needed = size/SB.block_size + (size%SB.block_size == 0 ? 0 : 1);
+        uint32_t count = resolveExtents(fp, fourbfield(entry, 1), needed, &extents);
+        if(count == 0 && needed > 0) return reply(fd, 0, "Corrupt file.\n", 14);
+        char head[64];
+        int hn = sprintf(head, "OK %u\n", size);
+        int failed = sendAll(fd, head, hn);
+        int64_t left = size;
+        uint32_t i;
+        for(i=0; i<count && !failed; i++){
+            off_t off = (off_t)extents[i].start*SB.block_size;
+            int64_t extlen = (int64_t)extents[i].count*SB.block_size < left ? (int64_t)extents[i].count*SB.block_size : left;
+            left -= extlen;
+            while(extlen > 0 && !failed){
+                ssize_t sent = sendfile(fd, IM.fd, &off, extlen);
+                if(sent < 0 && errno == EINTR) continue;
+                if(sent <= 0) failed = -1;
+                else extlen -= sent;
+            }
+        }
+        free(extents);
+        return failed;
+    }
+    FILE *out = open_memstream(&text, &len);
+    if(!strcmp(args[0], "info") && n == 1){
+        printDiskInfo(out);
+    }else if(!strcmp(args[0], "list") && (n == 1 || n == 2)){
+        uint32_t start, numblocks;
+        if(lookupDir(fp, n == 2 ? args[1] : "/", &start, &numblocks)){
+            printFileInfo(out, fp, start, numblocks);
+        }else{
+            fprintf(out, "Directory not found.\n");
+            ok = 0;
+        }
+    }else if(!strcmp(args[0], "stat") && n == 2){
+        char *entry = findEntry(fp, args[1]);
+        if(entry == NULL){
+            fprintf(out, "Not found.\n");
+            ok = 0;
+        }else{
+            fprintf(out, "Type: %s\n", (entry[0] & 7) == 5 ? "directory" : "file");
+            fprintf(out, "Size: %u\n", fourbfield(entry, 9));
+            fprintf(out, "Start block: %u\n", fourbfield(entry, 1));
+            fprintf(out, "Blocks: %u\n", entryBlocks(entry));
+            fprintf(out, "Modified: %4d/%02d/%02d %2d:%02d:%02d\n", twobfield(entry, 20), onebfield(entry, 22), onebfield(entry, 23),
+                (onebfield(entry, 24)+17)%24, onebfield(entry, 25), onebfield(entry, 26));
+        }
+    }else{
+        fprintf(out, "Unknown request or wrong arguments.\n");
+        ok = 0;
+    }
+    fclose(out);
+    int failed = reply(fd, ok, text, len);
+    free(text);
+    return failed;
+}
+
+//checks everything a put of size bytes to path can fail on before anything is written: the path, names,
+//entries in the way and free space for the data, the new directories and one extension of the last
+//directory that already exists. returns the error to reply with, or NULL if the put can go ahead
+char *putCheck(char *fp, char *path, int64_t size){
+    char prefix[4096];
+    char *slash = path;
+    uint32_t newdirs = 0;
+    int found = 1;
+    if(path[0] != '/' || strlen(path) >= sizeof(prefix)) return "Input format: /subdir/subdir/filename\n";
+    while(slash != NULL){
+        char *name = slash+1;
+        char *next = strchr(name, '/');
+        long len = next != NULL ? next-name : (long)strlen(name);
+        if(len == 0) return "Input format: /subdir/subdir/filename\n";
+        if(len > FILENAMELIM-1) return "Name too long.\n";
+        memcpy(prefix, path, name+len-path);
+        prefix[name+len-path] = '\0';
+        if(found){
+            char *entry = findEntry(fp, prefix);
+            if(entry == NULL) found = 0;
+            else if(next == NULL || (entry[0] & 7) != 5) return "file already exists.";
+        }
+        if(!found && next != NULL) newdirs++;
+        slash = next;
+    }
+    uint64_t blocks = (size+SB.block_size-1)/SB.block_size+newdirs+1;
+    if(blocks > FB.available) return "Not enough free space on disk.\n";
+    return NULL;
+}
+
+//answers a put: the data is received into a memory file first, then checked and written under the write
+//lock and committed before the lock is released, so readers never see the journal's private pages
+int servePut(int fd, FILE *in, char *path, int64_t size){
+    int data = memfd_create("diskd-put", 0);
+    char *buf = try_malloc(PUTCHUNK);
+    int64_t left = size;
+    while(data >= 0 && left > 0){
+        size_t n = fread(buf, 1, left < PUTCHUNK ? left : PUTCHUNK, in);
+        if(n == 0 || write(data, buf, n) != n) break;
+        left -= n;
+    }
+    free(buf);
+    if(data < 0 || left > 0){
+        if(data >= 0) close(data);
+        return -1;//the client is gone or out of memory
+    }
+    char *text;
+    size_t len;
+    FILE *out = open_memstream(&text, &len);
+    pthread_rwlock_wrlock(&imagelock);
+    char *error = putCheck(IM.map, path, size);
+    if(error != NULL){
+        fputs(error, out);
+    }else{
+        char src[64];
+        sprintf(src, "/proc/self/fd/%d", data);
+        putFile(src, path, IM.map, out);
+        writeSummary();
+    }
+    pthread_rwlock_unlock(&imagelock);
+    close(data);
+    fclose(out);
+    int failed = reply(fd, error == NULL, text, len);
+    free(text);
+    return failed;
+}
+
+//serves the requests of one connection until it closes
+void *serveClient(void *arg){
+    int fd = (long)arg;
+    FILE *in = fdopen(fd, "r");
+    char *line = NULL;
+    size_t cap = 0;
+    while(getline(&line, &cap, in) > 0){
+        char *args[4];
+        char *save;
+        int n = 0;
+        line[strcspn(line, "\r\n")] = '\0';
+        char *tok = strtok_r(line, "\t", &save);
+        while(tok != NULL && n < 4){
+            args[n++] = tok;
+            tok = strtok_r(NULL, "\t", &save);
+        }
+        if(n == 0) continue;
+        int failed;
+        if(!strcmp(args[0], "put") && n == 3){
+            int64_t size = atoll(args[2]);
+            if(size < 0 || size > 0xFFFFFFFFLL){
+                reply(fd, 0, "File too large.\n", 16);
+                break;//the data can't be skipped reliably
+            }
+            failed = servePut(fd, in, args[1], size);
+        }else{
+            pthread_rwlock_rdlock(&imagelock);
+            failed = serveRead(fd, args, n);
+            pthread_rwlock_unlock(&imagelock);
+        }
+        if(failed) break;
+    }
+    free(line);
+    fclose(in);
+    return NULL;
+}
+
+//listens on the socket and starts a thread for every connection
+void serveImage(char *sockpath, char *fp){
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(sockpath) >= sizeof(addr.sun_path)){
+        fprintf(stderr, "Socket path too long.\n");
+        exit(1);
+    }
+    strcpy(addr.sun_path, sockpath);
+    unlink(sockpath);
+    if(sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 128) < 0){
+        perror("Can't listen on socket");
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    buildFreeMap(fp);
+    fprintf(stderr, "Serving %s on %s\n", IM.name, sockpath);
+    while(serving){
+        int fd = accept(sock, NULL, NULL);
+        if(fd < 0){
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            perror("Error accepting connection");
+            exit(1);
+        }
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if(pthread_create(&thread, &attr, serveClient, (void *)(long)fd) != 0) close(fd);
+        pthread_attr_destroy(&attr);
+    }
+}
+#endif
+
+#if defined(CLIENT)
+//connects to diskd, sends one request and prints or saves the reply. exits 1 if the request failed
+int runClient(int argc, char *argv[]){
+    struct sockaddr_un addr;
+    char request[4096];
+    int local = -1;
+    int64_t size = 0;
+    if(argc >= 3 && !strcmp(argv[2], "info") && argc == 3){
+        sprintf(request, "info\n");
+    }else if(argc == 4 && (!strcmp(argv[2], "list") || !strcmp(argv[2], "stat"))){
+        snprintf(request, sizeof(request), "%s\t%s\n", argv[2], argv[3]);
+    }else if(argc == 5 && !strcmp(argv[2], "get")){
+        snprintf(request, sizeof(request), "get\t%s\n", argv[3]);
+    }else if(argc == 5 && !strcmp(argv[2], "put")){
+        struct stat sf;
+        if(!strcmp(argv[3], "-")){//stdin is spooled so its size is known up front
+            FILE *spool = tmpfile();
+            char buf[65536];
+            size_t n;
+            while(spool != NULL && (n = fread(buf, 1, sizeof(buf), stdin)) > 0) fwrite(buf, 1, n, spool);
+            if(spool == NULL || fflush(spool) != 0){
+                fprintf(stderr, "Can't read file.\n");
+                exit(1);
+            }
+            local = dup(fileno(spool));
+            lseek(local, 0, SEEK_SET);
+        }else if((local = open(argv[3], O_RDONLY)) < 0){
+            fprintf(stderr, "Can't open file.\n");
+            exit(1);
+        }
+        fstat(local, &sf);
+        size = sf.st_size;
+        snprintf(request, sizeof(request), "put\t%s\t%lld\n", argv[4], (long long)size);
+    }else{
+        fprintf(stderr, "USAGE: ./diskc [socket] info\n");
+        fprintf(stderr, "       ./diskc [socket] list|stat [path in disk]\n");
+        fprintf(stderr, "       ./diskc [socket] get [file in disk] [local copy name]\n");
+        fprintf(stderr, "       ./diskc [socket] put [local file] [path in disk]\n");
+        exit(1);
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path)-1);
+    if(sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+        fprintf(stderr, "Can't connect to %s.\n", argv[1]);
+        exit(1);
+    }
+    writeAll(sock, request, strlen(request));
+    while(size > 0){
+        ssize_t n = sendfile(sock, local, NULL, size);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0){
+            perror("Error sending file");
+            exit(1);
+        }
+        size -= n;
+    }
+    char head[64];
+    int i = 0;
+    while(i < sizeof(head)-1 && read(sock, head+i, 1) == 1 && head[i] != '\n') i++;
+    head[i] = '\0';
+    long long len;
+    char status[8];
+    if(sscanf(head, "%7s %lld", status, &len) != 2){
+        fprintf(stderr, "Bad reply from %s.\n", argv[1]);
+        exit(1);
+    }
+    int ok = !strcmp(status, "OK");
+    int out = ok ? STDOUT_FILENO : STDERR_FILENO;
+    if(ok && !strcmp(argv[2], "get") && strcmp(argv[4], "-") && (out = open(argv[4], O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0){
+        fprintf(stderr, "Can't open local file.\n");
+        exit(1);
+    }
+    char *buf = try_malloc(IOBUFSIZE);
+    while(len > 0){
+        ssize_t n = read(sock, buf, len < IOBUFSIZE ? len : IOBUFSIZE);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0){
+            fprintf(stderr, "Connection closed early.\n");
+            exit(1);
+        }
+        writeAll(out, buf, n);
+        len -= n;
+    }
+    free(buf);
+    return ok ? 0 : 1;
+}
+#endif
+
+#if defined(PACKING)
+//pack format: a header, then one record per run of up to PACKCHUNK bytes of blocks, then an end record whose
+//count is the number of blocks packed. every record holds its first block, block count, method, payload length
+//and the FNV-1a hash of the uncompressed data, and all fields are big-endian like the image's own
+#define PACKMAGIC "CSC360PK"
+#define PACKVERSION 1
+#define PACKHEADER 28
+#define PACKRECORD 17
+#define PACKCHUNK (1<<20)
+#define PACKSTORED 0
+#define PACKLZ 1
+#define PACKSKIP 2//a chunk of zeros, which isn't written and becomes a hole
+#define PACKEND 0xFFFFFFFF
+#define PACKCOMPRESSED 1
+#define PACKEXACT 2
+
+int packcompress = 0;
+int packexact = 0;
+
+//stores a big-endian 4-byte field
+void setFourbfield(char *buf, int64_t ndx, uint32_t value){
+    uint32_t temp = htonl(value);
+    memcpy(buf+ndx, &temp, 4);
+}
+
+//whether a buffer holds only zeros
+int allZero(char *buf, long len){
+    return len == 0 || (buf[0] == 0 && !memcmp(buf, buf+1, len-1));
+}
+
+//fast LZ77 compression in the style of LZ4. each sequence is a token holding the literal count and the match
+//length in 4 bits each (15 means more length bytes follow, 255 at a time), the literals, and the match's offset
+//back into the output in 2 bytes. the last sequence has literals only
+#define LZHASHBITS 14
+#define LZMINMATCH 4
+#define LZWINDOW 65535
+
+//writes the extra bytes of a length. returns the new output position, or NULL when it doesn't fit
+char *lzLength(char *op, char *oend, uint32_t len){
+    for(; len >= 255; len -= 255){
+        if(op >= oend) return NULL;
+        *op++ = (char)255;
+    }
+    if(op >= oend) return NULL;
+    *op++ = len;
+    return op;
+}
+
+//writes one sequence of nlit literals followed by a match, or by nothing when mlen is 0
+char *lzSequence(char *op, char *oend, char *lit, uint32_t nlit, uint32_t offset, uint32_t mlen){
+    uint32_t m = mlen > 0 ? mlen-LZMINMATCH : 0;
+    if(op >= oend) return NULL;
+    *op++ = (nlit < 15 ? nlit : 15)<<4 | (m < 15 ? m : 15);
+    if(nlit >= 15 && (op = lzLength(op, oend, nlit-15)) == NULL) return NULL;
+    if(oend-op < nlit) return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if(mlen == 0) return op;
+    if(oend-op < 2) return NULL;
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    if(m >= 15 && (op = lzLength(op, oend, m-15)) == NULL) return NULL;
+    return op;
+}
+
+//compresses len bytes into dst, which holds len bytes. returns the compressed length, or 0 when it
+//wouldn't be smaller than the input. the search skips ahead faster the longer it goes without a match
+uint32_t lzCompress(char *src, uint32_t len, char *dst){
+    uint32_t table[1<<LZHASHBITS];
+    char *op = dst, *oend = dst+len-1;
+    uint32_t i = 0, anchor = 0;
+    memset(table, 0xFF, sizeof(table));
+    while(len >= LZMINMATCH && i <= len-LZMINMATCH){
+        uint32_t v, w;
+        memcpy(&v, src+i, 4);
+        uint32_t h = (v*2654435761u)>>(32-LZHASHBITS);
+        uint32_t ref = table[h];
+        table[h] = i;
+        if(ref == 0xFFFFFFFF || i-ref > LZWINDOW || (memcpy(&w, src+ref, 4), w != v)){
+            i += 1+((i-anchor)>>6);
+            continue;
+        }
+        uint32_t mlen = LZMINMATCH;
+        while(i+mlen < len && src[ref+mlen] == src[i+mlen]) mlen++;
+        if((op = lzSequence(op, oend, src+anchor, i-anchor, i-ref, mlen)) == NULL) return 0;
+        i += mlen;
+        anchor = i;
+    }
+    if((op = lzSequence(op, oend, src+anchor, len-anchor, 0, 0)) == NULL) return 0;
+    return op-dst;
+}
+
+//reads the extra bytes of a length. returns the new input position, or NULL at the end of the input
+uint8_t *lzReadLength(uint8_t *ip, uint8_t *iend, uint32_t *len){
+    do{
+        if(ip >= iend) return NULL;
+        *len += *ip;
+    }while(*ip++ == 255);
+    return ip;
+}
+
+//expands clen bytes compressed by lzCompress into exactly len bytes. returns -1 if the input is corrupt
+int lzDecompress(char *src, uint32_t clen, char *dst, uint32_t len){
+    uint8_t *ip = (uint8_t *)src, *iend = ip+clen;
+    char *op = dst, *oend = dst+len;
+    while(ip < iend){
+        uint32_t nlit = *ip>>4, mlen = *ip&15;
+        ip++;
+        if(nlit == 15 && (ip = lzReadLength(ip, iend, &nlit)) == NULL) return -1;
+        if(iend-ip < nlit || oend-op < nlit) return -1;
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if(ip == iend) break;
+        if(iend-ip < 2) return -1;
+        uint32_t offset = ip[0] | ip[1]<<8;
+        ip += 2;
+        if(mlen == 15 && (ip = lzReadLength(ip, iend, &mlen)) == NULL) return -1;
+        mlen += LZMINMATCH;
+        if(offset == 0 || offset > op-dst || oend-op < mlen) return -1;
+        char *ref = op-offset;
+        if(offset >= mlen){
+            memcpy(op, ref, mlen);
+            op += mlen;
+        }else{
+            while(mlen-- > 0) *op++ = *ref++;
+        }
+    }
+    return op == oend ? 0 : -1;
+}
+
+//a chunk of blocks on its way through the pipeline
+#define SLOTFREE 0
+#define SLOTREAD 1
+#define SLOTBUSY 2
+#define SLOTDONE 3
+struct packslot_t{
+    int state;
+    uint32_t start;
+    uint32_t count;
+    uint32_t method;
+    uint32_t clen;
+    uint32_t checksum;
+    char *raw;
+    char *packed;
+};
+
+//reader, workers and writer connected by a ring of slots. the main thread reads chunks into the ring in
+//order, the workers (de)compress them as they come, and the writer thread drains the ring in order, so the
+//output keeps the input's order whichever worker finishes first. memory is bounded by the size of the ring
+struct pipeline_t{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct packslot_t *slots;
+    uint64_t nslots;
+    uint64_t nread;
+    uint64_t nworked;
+    uint64_t nwritten;
+    int ended;
+    int nworkers;
+    pthread_t *threads;
+    void (*work)(struct packslot_t *s);
+    void (*drain)(struct packslot_t *s);
+};
+
+struct pipeline_t PL;
+
+//takes the chunks in the order they were read and runs the work on them
+void *pipelineWorker(void *arg){
+    pthread_mutex_lock(&PL.lock);
+    for(;;){
+        while(PL.nworked == PL.nread && !PL.ended) pthread_cond_wait(&PL.changed, &PL.lock);
+        if(PL.nworked == PL.nread) break;
+        struct packslot_t *s = &PL.slots[PL.nworked++ % PL.nslots];
+        s->state = SLOTBUSY;
+        pthread_mutex_unlock(&PL.lock);
+        PL.work(s);
+        pthread_mutex_lock(&PL.lock);
+        s->state = SLOTDONE;
+        pthread_cond_broadcast(&PL.changed);
+    }
+    pthread_mutex_unlock(&PL.lock);
+    return NULL;
+}
+
+//drains the finished chunks in order and frees their slots for the reader
+void *pipelineWriter(void *arg){
+    pthread_mutex_lock(&PL.lock);
+    for(;;){
+        while(PL.nwritten == PL.nread ? !PL.ended : PL.slots[PL.nwritten % PL.nslots].state != SLOTDONE){
+            pthread_cond_wait(&PL.changed, &PL.lock);
+        }
+        if(PL.nwritten == PL.nread) break;
+        struct packslot_t *s = &PL.slots[PL.nwritten % PL.nslots];
+        pthread_mutex_unlock(&PL.lock);
+        PL.drain(s);
+        pthread_mutex_lock(&PL.lock);
+        s->state = SLOTFREE;
+        PL.nwritten++;
+        pthread_cond_broadcast(&PL.changed);
+    }
+    pthread_mutex_unlock(&PL.lock);
+    return NULL;
+}
+
+//starts --threads workers, or one per online cpu, and the writer
+void pipelineStart(void (*work)(struct packslot_t *s), void (*drain)(struct packslot_t *s)){
+    long i;
+    PL.nworkers = nthreads > 0 ? nthreads : sysconf(_SC_NPROCESSORS_ONLN);
+    if(PL.nworkers < 1) PL.nworkers = 1;
+    PL.nslots = 2*PL.nworkers+2;
+    PL.slots = try_malloc(PL.nslots*sizeof(struct packslot_t));
+    for(i=0; i<PL.nslots; i++){
+        PL.slots[i].state = SLOTFREE;
+        PL.slots[i].raw = try_malloc(PACKCHUNK);
+        PL.slots[i].packed = try_malloc(PACKCHUNK);
+    }
+    pthread_mutex_init(&PL.lock, NULL);
+    pthread_cond_init(&PL.changed, NULL);
+    PL.nread = PL.nworked = PL.nwritten = 0;
+    PL.ended = 0;
+    PL.work = work;
+    PL.drain = drain;
+    PL.threads = try_malloc((PL.nworkers+1)*sizeof(pthread_t));
+    for(i=0; i<PL.nworkers; i++){
+        pthread_create(&PL.threads[i], NULL, pipelineWorker, NULL);
+    }
+    pthread_create(&PL.threads[PL.nworkers], NULL, pipelineWriter, NULL);
+}
+
+//waits for the next slot of the ring to be free and returns it for the reader to fill
+struct packslot_t *pipelineSlot(void){
+    pthread_mutex_lock(&PL.lock);
+    while(PL.nread-PL.nwritten == PL.nslots) pthread_cond_wait(&PL.changed, &PL.lock);
+    struct packslot_t *s = &PL.slots[PL.nread % PL.nslots];
+    pthread_mutex_unlock(&PL.lock);
+    return s;
+}
+
+//hands the slot returned by pipelineSlot to the workers
+void pipelinePush(void){
+    pthread_mutex_lock(&PL.lock);
+    PL.slots[PL.nread % PL.nslots].state = SLOTREAD;
+    PL.nread++;
+    pthread_cond_broadcast(&PL.changed);
+    pthread_mutex_unlock(&PL.lock);
+}
+
+//lets the threads finish the chunks already read and waits for them
+void pipelineFinish(void){
+    long i;
+    pthread_mutex_lock(&PL.lock);
+    PL.ended = 1;
+    pthread_cond_broadcast(&PL.changed);
+    pthread_mutex_unlock(&PL.lock);
+    for(i=0; i<=PL.nworkers; i++){
+        pthread_join(PL.threads[i], NULL);
+    }
+    for(i=0; i<PL.nslots; i++){
+        free(PL.slots[i].raw);
+        free(PL.slots[i].packed);
+    }
+    free(PL.slots);
+    free(PL.threads);
+}
+#endif
+
+#if defined(PART12)
+//what diskpack wrote
+struct packstats_t{
+    int fd;
+    uint64_t blocks;
+    uint64_t records;
+    uint64_t bytes;
+};
+
+struct packstats_t PK;
+
+//hashes a chunk and compresses it with --compress. a chunk of zeros is dropped
+void packWork(struct packslot_t *s){
+    uint32_t len = s->count*SB.block_size;
+    if(allZero(s->raw, len)){
+        s->method = PACKSKIP;
+        return;
+    }
+    s->checksum = journalHash(2166136261u, s->raw, len);
+    s->method = PACKSTORED;
+    s->clen = len;
+    if(packcompress && (s->clen = lzCompress(s->raw, len, s->packed)) > 0) s->method = PACKLZ;
+    else s->clen = len;
+}
+
+//writes a chunk's record to the pack
+void packDrain(struct packslot_t *s){
+    char rec[PACKRECORD];
+    if(s->method == PACKSKIP) return;
+    setFourbfield(rec, 0, s->start);
+    setFourbfield(rec, 4, s->count);
+    rec[8] = s->method;
+    setFourbfield(rec, 9, s->clen);
+    setFourbfield(rec, 13, s->checksum);
+    writeAll(PK.fd, rec, PACKRECORD);
+    writeAll(PK.fd, s->method == PACKLZ ? s->packed : s->raw, s->clen);
+    PK.blocks += s->count;
+    PK.records++;
+    PK.bytes += PACKRECORD+s->clen;
+    STAT(bytes, PACKRECORD+s->clen);
+}
+
+//streams the superblock, the FAT, every allocated block and any bytes past the last block of the image to a
+//pack file, or to stdout for "-". free blocks are left out, or with --exact only those holding nothing but
+//zeros. the rest is read in chunks of PACKCHUNK bytes through the I/O backend and compressed by the workers.
+//the bytes past the last block are packed as further blocks, the last one padded with zeros
+void packImage(char *fp, char *out){
+    char head[PACKHEADER];
+    if(!strcmp(out, "-")){
+        PK.fd = STDOUT_FILENO;
+    }else if((PK.fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0){
+        fprintf(stderr, "Can't open pack file.\n");
+        exit(1);
+    }
+    memcpy(head, PACKMAGIC, 8);
+    head[8] = PACKVERSION>>8;
+    head[9] = PACKVERSION & 0xFF;
+    head[10] = SB.block_size>>8;
+    head[11] = SB.block_size & 0xFF;
+    setFourbfield(head, 12, SB.block_count);
+    setFourbfield(head, 16, (uint64_t)IM.size>>32);
+    setFourbfield(head, 20, (uint64_t)IM.size & 0xFFFFFFFF);
+    setFourbfield(head, 24, (packcompress ? PACKCOMPRESSED : 0) | (packexact ? PACKEXACT : 0));
+    writeAll(PK.fd, head, PACKHEADER);
+    PK.bytes = PACKHEADER;
+    if(FM.bits == NULL) buildFreeMap(fp);
+    pipelineStart(packWork, packDrain);
+    int phase = statsPhase(PHASETRANSFER);
+    uint32_t fatend = SB.FATstart+SB.FATblocks;
+    uint32_t per = PACKCHUNK/SB.block_size;
+    uint32_t block = 0;
+    uint32_t total = (IM.size+SB.block_size-1)/SB.block_size;
+    while(block < total){
+        uint32_t end = total;
+        if(block < fatend){
+            end = fatend < SB.block_count ? fatend : SB.block_count;
+        }else if(!packexact && block < FM.nblocks){
+            uint32_t run = freemapRun(block, FM.nblocks-block);
+            if(run > 0){
+                block += run;
+                continue;
+            }
+            end = freemapNext(block);
+            if(end >= FM.nblocks) end = total;
+        }
+        if(prefetching) hintRange((int64_t)block*SB.block_size, (int64_t)(end-block)*SB.block_size < READAHEAD ? (int64_t)(end-block)*SB.block_size : READAHEAD, 0);
+        while(block < end){
+            uint32_t n = end-block < per ? end-block : per;
+            struct packslot_t *s = pipelineSlot();
+            struct ioreq_t r = {s->raw, (int64_t)block*SB.block_size, (int64_t)n*SB.block_size};
+            if(r.off+r.len > IM.size){
+                memset(s->raw, 0, r.len);
+                r.len = IM.size-r.off;
+            }
+            if(IO->read(&r, 1) < 0){
+                perror("Error reading image");
+                exit(1);
+            }
+            s->start = block;
+            s->count = n;
+            pipelinePush();
+            block += n;
+        }
+    }
+    pipelineFinish();
+    statsPhase(phase);
+    char rec[PACKRECORD];
+    memset(rec, 0, PACKRECORD);
+    setFourbfield(rec, 0, PACKEND);
+    setFourbfield(rec, 4, PK.blocks);
+    writeAll(PK.fd, rec, PACKRECORD);
+    PK.bytes += PACKRECORD;
+    if(PK.fd != STDOUT_FILENO) close(PK.fd);
+    fprintf(PK.fd == STDOUT_FILENO ? stderr : stdout, "Packed %llu of %u blocks in %llu records, %llu bytes\n",
+        (unsigned long long)PK.blocks, SB.block_count, (unsigned long long)PK.records, (unsigned long long)PK.bytes);
+}
+#endif
+
+#if defined(PART13)
+int unpackfd;
+int64_t unpacksize;
+char *unpackpath = NULL;
+
+//removes a half-written image when unpacking fails
+void unpackAbort(void){
+    if(unpackpath != NULL) unlink(unpackpath);
+}
+
+//expands a chunk and checks it against the hash it was packed with
+void unpackWork(struct packslot_t *s){
+    uint32_t len = s->count*SB.block_size;
+    if(s->method == PACKLZ && lzDecompress(s->packed, s->clen, s->raw, len) < 0){
+        fprintf(stderr, "Corrupt pack at block %u.\n", s->start);
+        exit(1);
+    }
+    if(journalHash(2166136261u, s->raw, len) != s->checksum){
+        fprintf(stderr, "Corrupt pack at block %u: checksum mismatch.\n", s->start);
+        exit(1);
+    }
+}
+
+//writes a chunk into the new image
+void unpackDrain(struct packslot_t *s){
+    char *buf = s->raw;
+    int64_t off = (int64_t)s->start*SB.block_size;
+    int64_t len = (int64_t)s->count*SB.block_size;
+    if(off+len > unpacksize) len = unpacksize-off;//the padding of the bytes past the last block
+    while(len > 0){
+        ssize_t n = pwrite(unpackfd, buf, len, off);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0){
+            perror("Error writing image");
+            exit(1);
+        }
+        buf += n;
+        off += n;
+        len -= n;
+    }
+    STAT(bytes, s->count*SB.block_size);
+}
+
+//rebuilds an image from a pack file, or from stdin for "-". the new image starts out as one hole of the
+//right size and only the packed chunks are written, so free blocks stay holes
+int unpackImage(int argc, char *argv[]){
+    char head[PACKHEADER], rec[PACKRECORD];
+    int in;
+    if(argc != 3){
+        fprintf(stderr, "USAGE: ./diskunpack [pack file] [disk img]\n");
+        return 1;
+    }
+    if(!strcmp(argv[1], "-")){
+        in = STDIN_FILENO;
+    }else if((in = open(argv[1], O_RDONLY)) < 0){
+        fprintf(stderr, "Can't open pack file.\n");
+        exit(1);
+    }
+    if(readFull(in, head, PACKHEADER) != PACKHEADER || memcmp(head, PACKMAGIC, 8) || twobfield(head, 8) != PACKVERSION){
+        fprintf(stderr, "Not a disk pack.\n");
+        exit(1);
+    }
+    SB.block_size = twobfield(head, 10);
+    SB.block_count = fourbfield(head, 12);
+    int64_t size = ((int64_t)fourbfield(head, 16)<<32) | fourbfield(head, 20);
+    unpacksize = size;
+    if(SB.block_size == 0 || SB.block_size > PACKCHUNK || (int64_t)SB.block_count*SB.block_size > size){
+        fprintf(stderr, "Corrupt pack header.\n");
+        exit(1);
+    }
+    if((unpackfd = open(argv[2], O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0){
+        fprintf(stderr, "Can't create disk image, or it already exists.\n");
+        exit(1);
+    }
+    unpackpath = argv[2];
+    atexit(unpackAbort);
+    if(ftruncate(unpackfd, size) < 0){
+        perror("Error sizing image");
+        exit(1);
+    }
+    pipelineStart(unpackWork, unpackDrain);
+    int phase = statsPhase(PHASETRANSFER);
+    uint32_t per = PACKCHUNK/SB.block_size;
+    uint32_t total = (size+SB.block_size-1)/SB.block_size;
+    uint64_t blocks = 0, records = 0;
+    for(;;){
+        if(readFull(in, rec, PACKRECORD) != PACKRECORD){
+            fprintf(stderr, "Pack ends early.\n");
+            exit(1);
+        }
+        uint32_t start = fourbfield(rec, 0), count = fourbfield(rec, 4), clen = fourbfield(rec, 9);
+        uint32_t method = onebfield(rec, 8);
+        if(start == PACKEND){
+            if(count != (uint32_t)blocks){
+                fprintf(stderr, "Pack ends early.\n");
+                exit(1);
+            }
+            break;
+        }
+        if(count == 0 || count > per || start >= total || count > total-start
+            || (method == PACKSTORED ? clen != count*SB.block_size : method != PACKLZ || clen >= count*SB.block_size)){
+            fprintf(stderr, "Corrupt pack at block %u.\n", start);
+            exit(1);
+        }
+        struct packslot_t *s = pipelineSlot();
+        s->start = start;
+        s->count = count;
+        s->method = method;
+        s->clen = clen;
+        s->checksum = fourbfield(rec, 13);
+        if(readFull(in, method == PACKLZ ? s->packed : s->raw, clen) != clen){
+            fprintf(stderr, "Pack ends early.\n");
+            exit(1);
+        }
+        pipelinePush();
+        blocks += count;
+        records++;
+    }
+    pipelineFinish();
+    if(fsync(unpackfd) < 0 || close(unpackfd) < 0){
+        perror("Error writing image");
         exit(1);
     }
+    unpackpath = NULL;
+    statsPhase(phase);
+    printf("Unpacked %llu of %u blocks from %llu records\n", (unsigned long long)blocks, SB.block_count, (unsigned long long)records);
+    return 0;
+}
+#endif
+
+#if defined(JOURNALED)
+//tools that change the image journal their metadata unless --nojournal is given
+int journaling = 1;
+#endif
+
+//removes the --options from argv so the positional arguments keep their places
+void parseOptions(int *argc, char *argv[]){
+    int i, j = 1;
+    for(i=1; i<*argc; i++){
+        if(!strcmp(argv[i], "--rescan")){
+            IM.rescan = 1;
+        }else if(!strncmp(argv[i], "--threads=", 10)){
+            nthreads = atoi(argv[i]+10);
+        }else if(!strncmp(argv[i], "--io=", 5)){
+            pickBackend(argv[i]+5);
+        }else if(!strncmp(argv[i], "--mapcap=", 9)){
+            WM.cap = atol(argv[i]+9);
+        }else if(!strcmp(argv[i], "--noreadahead")){
+            prefetching = 0;
+        }else if(!strcmp(argv[i], "--stats") || !strcmp(argv[i], "--stats=text")){
+            ST.enabled = STATSTEXT;
+        }else if(!strcmp(argv[i], "--stats=json")){
+            ST.enabled = STATSJSON;
+#if defined(PART2)
+        }else if(!strcmp(argv[i], "-R")){
+            recursive = 1;
+#endif
+#if defined(PUTOPTIONS) || defined(PART11)
+        }else if(!strcmp(argv[i], "-r")){
+            putrecursive = 1;
+#endif
+#if defined(PUTOPTIONS)
+        }else if(!strcmp(argv[i], "--append")){
+            putmode = PUTAPPEND;
+        }else if(!strcmp(argv[i], "--update")){
+            putmode = PUTUPDATE;
+#endif
+#if defined(PUTOPTIONS) || defined(PART5) || defined(PART11)
+        }else if(!strcmp(argv[i], "--punch")){
+            PH.enabled = 1;
+#endif
+#if defined(PART4) && !defined(PART11)
+        }else if(!strcmp(argv[i], "--alloc=first")){
+            allocpolicy = FIRSTFIT;
+        }else if(!strcmp(argv[i], "--alloc=best")){
+            allocpolicy = BESTFIT;
+        }else if(!strcmp(argv[i], "--alloc=next")){
+            allocpolicy = NEXTFIT;
+#endif
+#if defined(JOURNALED)
+        }else if(!strcmp(argv[i], "--nojournal")){
+            journaling = 0;
+#endif
+#if defined(PART3)
+        }else if(!strncmp(argv[i], "--offset=", 9)){
+            getoffset = atoll(argv[i]+9);
+        }else if(!strncmp(argv[i], "--length=", 9)){
+            getlength = atoll(argv[i]+9);
+        }else if(!strncmp(argv[i], "--manifest=", 11)){
+            manifest = argv[i]+11;
+#endif
+#if defined(PART6)
+        }else if(!strcmp(argv[i], "--report")){
+            reportonly = 1;
+#endif
+#if defined(PART7)
+        }else if(!strcmp(argv[i], "--repair")){
+            repair = 1;
+#endif
+#if defined(PART8)
+        }else if(!strcmp(argv[i], "-l")){
+            FF.details = 1;
+        }else if(!strcmp(argv[i], "--type=f")){
+            FF.type = FILESONLY;
+        }else if(!strcmp(argv[i], "--type=d")){
+            FF.type = DIRSONLY;
+        }else if(!strncmp(argv[i], "--minsize=", 10)){
+            FF.minsize = parseSize(argv[i]+10);
+        }else if(!strncmp(argv[i], "--maxsize=", 10)){
+            FF.maxsize = parseSize(argv[i]+10);
+        }else if(!strncmp(argv[i], "--after=", 8)){
+            FF.after = parseDate(argv[i]+8);
+        }else if(!strncmp(argv[i], "--before=", 9)){
+            FF.before = parseDate(argv[i]+9);
+#endif
+#if defined(PACKING)
+        }else if(!strcmp(argv[i], "--compress")){
+            packcompress = 1;
+        }else if(!strcmp(argv[i], "--exact")){
+            packexact = 1;
+#endif
+#if defined(PART5)
+        }else if(!strncmp(argv[i], "--checkpoint=", 13)){
+            checkpoint = atol(argv[i]+13);
+        }else if(!strcmp(argv[i], "--dirindex")){
+            persistindex = 1;
+#endif
+        }else if(!strncmp(argv[i], "--", 2)){
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            exit(1);
+        }else{
+            argv[j++] = argv[i];
+        }
+    }
+    *argc = j;
+}
+
+//opens and maps a disk image. returns the mapping
+char *openImage(char *disk_name){
+    int fp;
+    struct stat sf;
+    char *p;
     if((fp = open(disk_name, O_RDWR)) >= 0){
+        journalReplay(fp, disk_name);
         fstat(fp, &sf);
-        p = mmap(NULL, sf.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fp, 0);
+        if(WM.cap > 0 && sf.st_size > WM.cap*1024*1024){
+            p = windowReserve(sf.st_size);
+        }else if((p = mmap(NULL, sf.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fp, 0)) == MAP_FAILED){
+            p = windowReserve(sf.st_size);//doesn't fit the address space in one piece
+        }
+        if(p == MAP_FAILED){
+            perror("Can't map disk file");
+            exit(1);
+        }
     }else{
         fprintf(stderr, "Can't open disk file.\n");
-        close(fp);
+        exit(1);
+    }
+    IM.name = disk_name;
+    IM.fd = fp;
+    IM.map = p;
+    IM.size = sf.st_size;
+    if(IO->init != NULL) IO->init();
+#if defined(JOURNALED)
+    if(journaling){
+        JN.enabled = 1;
+        JN.fd = -1;
+        JN.pagesize = sysconf(_SC_PAGESIZE);
+        JN.private = try_malloc(IM.size/JN.pagesize+1);
+        memset(JN.private, 0, IM.size/JN.pagesize+1);
+    }
+#endif
+    return p;
+}
+
+int main(int argc, char* argv[]){
+    char *p;
+#if defined(CLIENT)
+    return runClient(argc, argv);
+#endif
+    parseOptions(&argc, argv);
+    if(ST.enabled) statsStart(argv[0]);
+#if defined(PART13)
+    return unpackImage(argc, argv);
+#endif
+    int phase = statsPhase(PHASESUPER);
+    if(argc > 1){
+        p = openImage(argv[1]);
+    }else{
+        fprintf(stderr, "Must specify a disc image.\n");
         exit(1);
     }
     readSuperBlock(p);
-    #if defined(PART1)
-        if(argc == 2) printDiskInfo();
+    statsPhase(phase);
+    #if defined(BENCH)
+        if(argc == 3 && !strcmp(argv[2], "fat")) benchFAT(p);
+        else if(argc == 4 && !strcmp(argv[2], "get")) benchGet(p, argv[3]);
+        else if(argc == 4 && !strcmp(argv[2], "io")) benchIO(p, argv[3]);
+        else fprintf(stderr, "USAGE: ./diskbench [disk img] fat|get|io [file in disk]\n");
+    #elif defined(PART5)
+        if(argc == 2 || argc == 3) runBatch(argc == 3 ? argv[2] : "-", p);
+        else fprintf(stderr, "USAGE: ./diskbatch [disk img] [script]\n");
+    #elif defined(PART12)
+        if(argc == 3) packImage(p, argv[2]);
+        else fprintf(stderr, "USAGE: ./diskpack [disk img] [pack file] [--compress] [--exact]\n");
+    #elif defined(PART11)
+        if(argc == 3){
+            removeEntry(argv[2], p, putrecursive);//-r is parsed with diskput's options
+            writeSummary();
+        }else{
+            fprintf(stderr, "USAGE: ./diskrm [disk img] [path in disk] [-r] [--punch]\n");
+        }
+    #elif defined(PART10)
+        if(argc == 4){
+            moveEntry(argv[2], argv[3], p);
+            writeSummary();
+        }else{
+            fprintf(stderr, "USAGE: ./diskmv [disk img] [path in disk] [new path in disk]\n");
+        }
+    #elif defined(PART9)
+        if(argc == 3) serveImage(argv[2], p);
+        else fprintf(stderr, "USAGE: ./diskd [disk img] [socket]\n");
+    #elif defined(PART8)
+        if(argc == 3 || argc == 4) findEntries(argv[2], argc == 4 ? argv[3] : "/", p);
+        else fprintf(stderr, "USAGE: ./diskfind [disk img] [pattern] [directory] [-l] [--type=f|d] [--minsize=N] [--maxsize=N] [--after=DATE] [--before=DATE]\n");
+    #elif defined(PART7)
+        if(argc == 2) diskCheck(p);
+        else fprintf(stderr, "USAGE: ./diskcheck [disk img] [--repair]\n");
+    #elif defined(PART6)
+        if(argc == 2) defragImage(p);
+        else fprintf(stderr, "USAGE: ./diskdefrag [disk img] [--report]\n");
+    #elif defined(PART1)
+        if(argc == 2) printDiskInfo(stdout);
         else fprintf(stderr, "USAGE: ./diskinfo [disk img]\n");
     #elif defined(PART2)
-        if(argc == 3) printDirInfo(argv[2], p, SB.rootstart, SB.root_block_count);
-        else fprintf(stderr, "USAGE: ./disklist [disk img] [directory]\n");
+        if(argc == 3 && recursive) listRecursive(argv[2], p);
+        else if(argc == 3) printDirInfo(argv[2], p, SB.rootstart, SB.root_block_count);
+        else fprintf(stderr, "USAGE: ./disklist [disk img] [directory] [-R]\n");
     #elif defined(PART3)
-        if(argc == 4) getFile(argv[2], p, SB.rootstart, SB.root_block_count, argv[3]);
-        else fprintf(stderr, "USAGE: ./diskget [disk img] [file in disk] [local copy name]\n");
+        if(argc == 3 && manifest != NULL) getMany(NULL, p, argv[2]);
+        else if(argc == 4 && (getoffset > 0 || getlength >= 0)) getRange(argv[2], p, argv[3]);
+        else if(argc == 4 && isBulkGet(p, argv[2])) getMany(argv[2], p, argv[3]);
+        else if(argc == 4) getFile(argv[2], p, SB.rootstart, SB.root_block_count, argv[3]);
+        else{
+            fprintf(stderr, "USAGE: ./diskget [disk img] [file in disk] [local copy name] [--offset=N] [--length=N]\n");
+            fprintf(stderr, "       ./diskget [disk img] [directory or glob in disk] [local directory]\n");
+            fprintf(stderr, "       ./diskget [disk img] --manifest=[list of paths in disk] [local directory]\n");
+        }
     #elif defined(PART4)
-        if(argc == 4) putFile(argv[2], argv[3], p);
-        else fprintf(stderr, "USAGE: ./diskput [disk img] [local filename] [disk directory]\n");
+        if(putrecursive && putmode != PUTNEW){
+            fprintf(stderr, "-r can't be used with --append or --update.\n");
+            exit(1);
+        }else if(argc == 4 && putrecursive){
+            putTree(argv[2], argv[3], p);
+            writeSummary();
+        }else if(argc == 4){
+            putFile(argv[2], argv[3], p, stdout);
+            writeSummary();
+        }else{
+            fprintf(stderr, "USAGE: ./diskput [disk img] [local filename] [disk directory]\n");
+            fprintf(stderr, "       ./diskput -r [disk img] [local directory] [disk directory]\n");
+            fprintf(stderr, "       ./diskput --append|--update [disk img] [local filename] [file in disk]\n");
+        }
     #endif
     return 0;
 }
@@ -0,0 +1,19 @@
+#!/bin/sh
+# reads files back with get in the same diskbatch transaction that put them. the data is still in pages
+# the journal made private, so the get has to see it through the mapping rather than the file.
+# usage: tests/batch_get.sh [directory holding the tools], run from ass3
+bin=${1:-.}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cp test.img "$work/t.img"
+head -c 300 /dev/urandom > "$work/small1"
+{
+    echo "put $work/small1 /n/x"
+    echo "get /n/x $work/out1"
+    echo "put $work/small1 /y"
+    echo "get /y $work/out2"
+} > "$work/script"
+$bin/diskbatch "$work/t.img" "$work/script" > /dev/null || { echo "FAIL: batch"; exit 1; }
+cmp -s "$work/small1" "$work/out1" || { echo "FAIL: /n/x read back stale"; exit 1; }
+cmp -s "$work/small1" "$work/out2" || { echo "FAIL: /y read back stale"; exit 1; }
+echo "PASS: batch_get"
@@ -0,0 +1,23 @@
+#!/bin/sh
+# renames a file in place with diskbatch and then fills the rest of its directory with puts in the same
+# batch. the renamed entry must keep its slot: it has to still be listed and read back afterwards.
+# usage: tests/batch_mv.sh [directory holding the tools], run from ass3
+bin=${1:-.}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cp test.img "$work/t.img"
+$bin/diskget "$work/t.img" /foo.txt "$work/foo.orig" > /dev/null || exit 1
+echo data > "$work/small"
+{
+    echo "mv /foo.txt /bar.txt"
+    i=1
+    while [ $i -le 61 ]; do
+        echo "put $work/small /f$i"
+        i=$((i+1))
+    done
+} > "$work/script"
+$bin/diskbatch "$work/t.img" "$work/script" > /dev/null || { echo "FAIL: batch"; exit 1; }
+$bin/disklist "$work/t.img" / | grep -q " bar.txt " || { echo "FAIL: /bar.txt lost its slot"; exit 1; }
+$bin/disklist "$work/t.img" / | grep -q " f61 " || { echo "FAIL: /f61 missing"; exit 1; }
+$bin/diskget "$work/t.img" /bar.txt "$work/bar" > /dev/null && cmp -s "$work/foo.orig" "$work/bar" || { echo "FAIL: /bar.txt contents"; exit 1; }
+echo "PASS: batch_mv"
@@ -0,0 +1,56 @@
+#!/bin/sh
+# builds a small image, damages it with a crosslink, a chain broken at its first block and orphaned
+# blocks, and checks what diskcheck reports and what --repair leaves behind.
+# usage: tests/check_repair.sh [directory holding the tools], run from ass3
+bin=${1:-.}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+img="$work/r.img"
+# superblock: 512 byte blocks, 256 of them, FAT at block 1 for 2 blocks, root at block 3 for 1
+printf 'CSC360FS\002\000\000\000\001\000\000\000\000\001\000\000\000\002\000\000\000\003\000\000\000\001' > "$img"
+truncate -s 131072 "$img"
+# blocks 0 to 2 reserved and the root's end of chain
+printf '\000\000\000\001\000\000\000\001\000\000\000\001\377\377\377\377' | dd of="$img" bs=512 seek=1 conv=notrunc 2> /dev/null
+# /a, /b, /c and /d take blocks 4-6, 7-9, 10-12 and 13-15
+for f in a b c d; do
+    head -c 1400 /dev/urandom > "$work/$f"
+    $bin/diskput "$img" "$work/$f" /$f --alloc=first > /dev/null || exit 1
+done
+rm -f "$img".*
+fat(){
+    printf "$2" | dd of="$img" bs=4 seek=$((128+$1)) conv=notrunc 2> /dev/null
+}
+# /b's second block links into /a, which orphans block 9
+fat 8 '\000\000\000\005'
+# /c's first block is free, which orphans blocks 11 and 12
+fat 10 '\000\000\000\000'
+fat 200 '\377\377\377\377'
+fat 201 '\377\377\377\377'
+cat > "$work/expected" <<END
+/b: crosslinked at block 5
+/b: chain has 4 blocks, entry needs 3
+/c: chain broken at block 10 after 0 blocks
+/c: chain has 0 blocks, entry needs 3
+5 orphaned blocks, the first at block 9
+Checked 0 directories, 4 files, 11 blocks: 5 problems
+END
+$bin/diskcheck "$img" > "$work/report" && { echo "FAIL: damage not reported"; exit 1; }
+sed 's/ in [0-9.]* s:/:/' "$work/report" | cmp -s "$work/expected" - || { echo "FAIL: report"; cat "$work/report"; exit 1; }
+
+$bin/diskcheck "$img" --repair > "$work/repair" || { echo "FAIL: repair left problems"; cat "$work/repair"; exit 1; }
+[ "$(grep -c "After repair" "$work/repair")" = 1 ] || { echo "FAIL: repair took more than one round"; cat "$work/repair"; exit 1; }
+grep -q "After repair: 0 problems" "$work/repair" || { echo "FAIL: repair"; exit 1; }
+$bin/diskcheck "$img" | grep -q ": 0 problems" || { echo "FAIL: problems after repair"; exit 1; }
+# 256 blocks less 3 reserved, the root and three 3 block files
+$bin/diskinfo "$img" | grep -q "Free Blocks: 243" || { echo "FAIL: free count after repair"; $bin/diskinfo "$img"; exit 1; }
+for f in a d; do
+    $bin/diskget "$img" /$f "$work/out" > /dev/null && cmp -s "$work/$f" "$work/out" || { echo "FAIL: /$f changed"; exit 1; }
+done
+# /b keeps its own two blocks and gets a copy of the block it shared with /a. its old third block was
+# orphaned and is gone, as is everything /c had
+$bin/diskget "$img" /b "$work/out" > /dev/null || { echo "FAIL: get /b"; exit 1; }
+head -c 1024 "$work/b" > "$work/want"
+head -c 1400 "$work/a" | tail -c 888 | head -c 376 >> "$work/want"
+cmp -s "$work/want" "$work/out" || { echo "FAIL: /b contents"; exit 1; }
+$bin/disklist "$img" / | grep -q " 0 *c " || { echo "FAIL: /c not emptied"; $bin/disklist "$img" /; exit 1; }
+echo "PASS: check_repair"
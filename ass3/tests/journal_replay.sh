@@ -0,0 +1,54 @@
+#!/bin/sh
+# stops diskbatch right after its journal is synced, as a crash would, and checks that the next tool to
+# open the image replays it. puts in one batch share one transaction, so all of them come back, and
+# puts after a sync are lost along with the commit that never ran. a torn journal is dropped unapplied.
+# usage: tests/journal_replay.sh [directory holding the tools], run from ass3
+bin=${1:-.}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+head -c 3000 /dev/urandom > "$work/a"
+head -c 700 /dev/urandom > "$work/b"
+$bin/disklist test.img / > "$work/list.orig" || exit 1
+# test.img has problems of its own, so diskcheck is compared against what it finds there
+cp test.img "$work/t.img"
+$bin/diskcheck "$work/t.img" | sed '$d' > "$work/check.orig"
+rm -f "$work/t.img.fsum"
+
+# group commit: three puts, one transaction
+cp test.img "$work/t.img"
+{
+    echo "put $work/a /r/a"
+    echo "put $work/b /r/b"
+    echo "put $work/a /c"
+} > "$work/script"
+FJNL_CRASH=1 $bin/diskbatch "$work/t.img" "$work/script" > /dev/null 2>&1
+[ -s "$work/t.img.fjnl" ] || { echo "FAIL: no journal left behind"; exit 1; }
+$bin/disklist "$work/t.img" / 2> "$work/replay" | grep -q " c " || { echo "FAIL: /c not replayed"; exit 1; }
+grep -q "Replayed 1 journal transaction" "$work/replay" || { echo "FAIL: expected one transaction"; cat "$work/replay"; exit 1; }
+[ -s "$work/t.img.fjnl" ] && { echo "FAIL: journal not emptied"; exit 1; }
+$bin/diskget "$work/t.img" /r/a "$work/out" > /dev/null && cmp -s "$work/a" "$work/out" || { echo "FAIL: /r/a contents"; exit 1; }
+$bin/diskget "$work/t.img" /r/b "$work/out" > /dev/null && cmp -s "$work/b" "$work/out" || { echo "FAIL: /r/b contents"; exit 1; }
+$bin/diskcheck "$work/t.img" | sed '$d' | cmp -s "$work/check.orig" - || { echo "FAIL: diskcheck after replay"; exit 1; }
+
+# the commit at sync is the one that crashes, so the put after it never lands
+cp test.img "$work/t.img"
+rm -f "$work/t.img.fjnl"
+printf "put $work/a /s1\nsync\nput $work/b /s2\n" > "$work/script"
+FJNL_CRASH=1 $bin/diskbatch "$work/t.img" "$work/script" > /dev/null 2>&1
+$bin/disklist "$work/t.img" / > "$work/list" 2> /dev/null
+grep -q " s1 " "$work/list" || { echo "FAIL: /s1 not replayed"; exit 1; }
+grep -q " s2 " "$work/list" && { echo "FAIL: /s2 applied without a commit"; exit 1; }
+$bin/diskcheck "$work/t.img" | sed '$d' | cmp -s "$work/check.orig" - || { echo "FAIL: diskcheck after sync crash"; exit 1; }
+
+# a journal cut short has no valid commit record and must leave the image as it was
+cp test.img "$work/t.img"
+rm -f "$work/t.img.fjnl"
+echo "put $work/a /torn" > "$work/script"
+FJNL_CRASH=1 $bin/diskbatch "$work/t.img" "$work/script" > /dev/null 2>&1
+size=$(wc -c < "$work/t.img.fjnl")
+head -c $((size-8)) "$work/t.img.fjnl" > "$work/torn" && cp "$work/torn" "$work/t.img.fjnl"
+$bin/disklist "$work/t.img" / > "$work/list" 2> "$work/replay"
+cmp -s "$work/list.orig" "$work/list" || { echo "FAIL: torn journal was applied"; exit 1; }
+grep -q "Replayed" "$work/replay" && { echo "FAIL: torn journal reported as replayed"; exit 1; }
+$bin/diskcheck "$work/t.img" | sed '$d' | cmp -s "$work/check.orig" - || { echo "FAIL: diskcheck after torn journal"; exit 1; }
+echo "PASS: journal_replay"
@@ -0,0 +1,55 @@
+#!/bin/sh
+# packs and unpacks an image whose freed blocks still hold old data, in every mode. the default and
+# --compress packs must rebuild an image the tools can't tell apart from the original, --exact packs must
+# rebuild it byte for byte, and a truncated or damaged pack must fail without leaving an image behind.
+# usage: tests/pack_roundtrip.sh [directory holding the tools], run from ass3
+bin=${1:-.}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cp test.img "$work/t.img"
+head -c 200000 /dev/urandom > "$work/junk"
+head -c 5000 /dev/urandom > "$work/keep"
+$bin/diskput "$work/t.img" "$work/junk" /junk > /dev/null || exit 1
+$bin/diskput "$work/t.img" "$work/keep" /d/keep > /dev/null || exit 1
+# /junk's blocks are free after this but still hold its data
+$bin/diskrm "$work/t.img" /junk > /dev/null || exit 1
+$bin/disklist "$work/t.img" / -R > "$work/list.orig"
+$bin/diskcheck "$work/t.img" | sed '$d' > "$work/check.orig"
+$bin/diskget "$work/t.img" / "$work/files.orig" > /dev/null || exit 1
+
+# the rebuilt image must look the same to disklist, diskcheck and diskget
+same(){
+    $bin/disklist "$work/u.img" / -R | cmp -s "$work/list.orig" - || { echo "FAIL: $1: listing differs"; exit 1; }
+    $bin/diskcheck "$work/u.img" | sed '$d' | cmp -s "$work/check.orig" - || { echo "FAIL: $1: diskcheck differs"; exit 1; }
+    rm -rf "$work/files"
+    $bin/diskget "$work/u.img" / "$work/files" > /dev/null && diff -r "$work/files.orig" "$work/files" > /dev/null || { echo "FAIL: $1: contents differ"; exit 1; }
+}
+
+for mode in "" --compress --exact "--compress --exact"; do
+    rm -f "$work/p" "$work/u.img"*
+    $bin/diskpack "$work/t.img" "$work/p" $mode > /dev/null || { echo "FAIL: pack $mode"; exit 1; }
+    $bin/diskunpack "$work/p" "$work/u.img" > /dev/null || { echo "FAIL: unpack $mode"; exit 1; }
+    same "${mode:-default}"
+    case "$mode" in
+        *--exact*) cmp -s "$work/t.img" "$work/u.img" || { echo "FAIL: $mode: image not byte-identical"; exit 1; };;
+        "") cmp -s "$work/t.img" "$work/u.img" && { echo "FAIL: default: dirty free blocks were packed"; exit 1; };;
+    esac
+done
+
+# through pipes
+rm -f "$work/u.img"*
+$bin/diskpack "$work/t.img" - --compress | $bin/diskunpack - "$work/u.img" > /dev/null || { echo "FAIL: unpack from a pipe"; exit 1; }
+same pipe
+
+# a pack cut short or damaged leaves nothing behind
+$bin/diskpack "$work/t.img" "$work/p" --compress > /dev/null || exit 1
+size=$(wc -c < "$work/p")
+head -c $((size/2)) "$work/p" > "$work/short"
+rm -f "$work/u.img"*
+$bin/diskunpack "$work/short" "$work/u.img" > /dev/null 2>&1 && { echo "FAIL: truncated pack unpacked"; exit 1; }
+[ -e "$work/u.img" ] && { echo "FAIL: truncated pack left an image behind"; exit 1; }
+cp "$work/p" "$work/bad"
+printf '\125\252' | dd of="$work/bad" bs=1 seek=$((size/2)) conv=notrunc 2> /dev/null
+$bin/diskunpack "$work/bad" "$work/u.img" > /dev/null 2>&1 && { echo "FAIL: damaged pack unpacked"; exit 1; }
+[ -e "$work/u.img" ] && { echo "FAIL: damaged pack left an image behind"; exit 1; }
+echo "PASS: pack_roundtrip"
@@ -0,0 +1,15 @@
+#!/bin/sh
+# removes a file and puts another one into the freed blocks in the same batch with --punch and without the
+# journal. the holes for the removed file must be punched before its blocks are reused, not after.
+# usage: tests/punch_nojournal.sh [directory holding the tools], run from ass3
+bin=${1:-.}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cp test.img "$work/t.img"
+head -c 400000 /dev/urandom > "$work/old"
+head -c 400000 /dev/urandom > "$work/new"
+$bin/diskput "$work/t.img" "$work/old" /old > /dev/null || { echo "FAIL: put"; exit 1; }
+printf 'rm /old\nput %s /new\n' "$work/new" > "$work/script"
+$bin/diskbatch --nojournal --punch "$work/t.img" "$work/script" > /dev/null || { echo "FAIL: batch"; exit 1; }
+$bin/diskget "$work/t.img" /new "$work/back" > /dev/null && cmp -s "$work/new" "$work/back" || { echo "FAIL: /new was punched"; exit 1; }
+echo "PASS: punch_nojournal"
@@ -0,0 +1,34 @@
+#!/bin/sh
+# runs put, get and check with --mapcap=1 on a sparse 512 MB image, so at most 8 of its 32 windows can be
+# mapped at once. the only free blocks are 16 near the start of every window but the first, so one put
+# is spread over 31 windows and windows keep being unmapped and mapped again under it.
+# usage: tests/windowed.sh [directory holding the tools], run from ass3
+bin=${1:-.}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+img="$work/w.img"
+# superblock: 4096 byte blocks, 131072 of them, FAT at block 1 for 128 blocks, root at block 129 for 1
+printf 'CSC360FS\020\000\000\002\000\000\000\000\000\001\000\000\000\200\000\000\000\201\000\000\000\001' > "$img"
+# every FAT entry reserved, then the root's end of chain and the free holes
+printf '\000\000\000\001' > "$work/fat"
+i=0
+while [ $i -lt 17 ]; do
+    cat "$work/fat" "$work/fat" > "$work/fat2" && mv "$work/fat2" "$work/fat"
+    i=$((i+1))
+done
+dd if="$work/fat" of="$img" bs=4096 seek=1 conv=notrunc 2> /dev/null
+printf '\377\377\377\377' | dd of="$img" bs=4 seek=$((1024+129)) conv=notrunc 2> /dev/null
+w=1
+while [ $w -lt 32 ]; do
+    dd if=/dev/zero of="$img" bs=4 seek=$((1024+w*4096+8)) count=16 conv=notrunc 2> /dev/null
+    w=$((w+1))
+done
+truncate -s 512M "$img"
+head -c 2031000 /dev/urandom > "$work/data"
+$bin/diskput "$img" "$work/data" /spread --mapcap=1 > "$work/put" || { echo "FAIL: put"; exit 1; }
+grep -q "in 31 extents" "$work/put" || { echo "FAIL: the put didn't cross every window"; cat "$work/put"; exit 1; }
+$bin/diskget "$img" /spread "$work/out" --mapcap=1 > /dev/null && cmp -s "$work/data" "$work/out" || { echo "FAIL: get"; exit 1; }
+$bin/diskget "$img" /spread "$work/out" --mapcap=1 --io=pread > /dev/null && cmp -s "$work/data" "$work/out" || { echo "FAIL: get with pread"; exit 1; }
+$bin/disklist "$img" / --mapcap=1 | grep -q " spread" || { echo "FAIL: list"; exit 1; }
+$bin/diskcheck "$img" --mapcap=1 | grep -q ": 0 problems" || { echo "FAIL: check"; $bin/diskcheck "$img"; exit 1; }
+echo "PASS: windowed"